@@ -0,0 +1,211 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mainloop.h"
+#include "capture.h"
+
+/*
+	Records are appended to an in-memory block on the mainloop. Full
+	blocks are handed to a writer thread, which appends them to the file
+	with one write() each, while the mainloop carries on filling the
+	other block. If the writer is still busy with the previous block the
+	new one is dropped and its records counted.
+*/
+
+#define CAPTURE_BLOCK (32 * 1024)
+
+static struct
+{
+	unsigned char block[2][CAPTURE_BLOCK];
+	int fill;		/* block the mainloop appends to */
+	int used;		/* bytes used in block[fill] */
+	int records;		/* records in block[fill] */
+
+	int pending;		/* block waiting for the writer, -1 = none */
+	int pending_len;
+	bool closing;
+
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	unsigned int dropped;
+}
+cap =
+{
+	.fill = 0,
+	.used = 0,
+	.records = 0,
+	.pending = -1,
+	.pending_len = 0,
+	.closing = FALSE,
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.dropped = 0,
+};
+
+
+static void *capture_thread(void *unused)
+{
+	int block, len, done;
+
+	pthread_mutex_lock(&cap.lock);
+	while (1)
+	{
+		while (cap.pending == -1 && !cap.closing)
+		{
+			pthread_cond_wait(&cap.cond, &cap.lock);
+		}
+
+		if (cap.pending == -1)
+		{
+			break;
+		}
+
+		block = cap.pending;
+		len = cap.pending_len;
+		pthread_mutex_unlock(&cap.lock);
+
+		for (done = 0; done < len; )
+		{
+			int r = write(cap.fd, cap.block[block] + done, len - done);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			done += r;
+		}
+
+		pthread_mutex_lock(&cap.lock);
+		cap.pending = -1;
+		pthread_cond_broadcast(&cap.cond);
+	}
+	pthread_mutex_unlock(&cap.lock);
+
+	return NULL;
+}
+
+/* hand the current block to the writer and start on the other one */
+
+void capture_flush(void)
+{
+	if (cap.fd == -1 || cap.used == 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&cap.lock);
+	if (cap.pending == -1)
+	{
+		cap.pending = cap.fill;
+		cap.pending_len = cap.used;
+		cap.fill ^= 1;
+		pthread_cond_signal(&cap.cond);
+	}
+	else
+	{
+		cap.dropped += cap.records;
+	}
+	pthread_mutex_unlock(&cap.lock);
+
+	cap.used = 0;
+	cap.records = 0;
+}
+
+void capture_frame(int direction, uint64_t usec, const unsigned char *msg, int length)
+{
+	capture_record rec;
+
+	if (cap.fd == -1)
+	{
+		return;
+	}
+
+	if (cap.used + sizeof(rec) + length > CAPTURE_BLOCK)
+	{
+		capture_flush();
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.usec = usec;
+	rec.length = length;
+	rec.direction = direction;
+
+	memcpy(cap.block[cap.fill] + cap.used, &rec, sizeof(rec));
+	memcpy(cap.block[cap.fill] + cap.used + sizeof(rec), msg, length);
+	cap.used += sizeof(rec) + length;
+	cap.records++;
+}
+
+int capture_open(const char *path)
+{
+	capture_header hdr;
+	struct timespec ts;
+
+	cap.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (cap.fd == -1)
+	{
+		return -1;
+	}
+
+	if (pthread_create(&cap.thread, NULL, capture_thread, NULL) != 0)
+	{
+		close(cap.fd);
+		cap.fd = -1;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.realtime_usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	hdr.monotonic_usec = mainloop_get_usec();
+
+	memcpy(cap.block[cap.fill], &hdr, sizeof(hdr));
+	cap.used = sizeof(hdr);
+
+	return 0;
+}
+
+unsigned int capture_dropped(void)
+{
+	return cap.dropped;
+}
+
+void capture_close(void)
+{
+	if (cap.fd == -1)
+	{
+		return;
+	}
+
+	/* let the writer finish the previous block so the last one isn't dropped */
+	pthread_mutex_lock(&cap.lock);
+	while (cap.pending != -1)
+	{
+		pthread_cond_wait(&cap.cond, &cap.lock);
+	}
+	pthread_mutex_unlock(&cap.lock);
+
+	capture_flush();
+
+	pthread_mutex_lock(&cap.lock);
+	cap.closing = TRUE;
+	pthread_cond_broadcast(&cap.cond);
+	pthread_mutex_unlock(&cap.lock);
+	pthread_join(cap.thread, NULL);
+
+	fdatasync(cap.fd);
+	close(cap.fd);
+	cap.fd = -1;
+}
@@ -0,0 +1,37 @@
+/*
+	Binary bus capture. A file is a sequence of sessions, each one a
+	capture_header followed by records: a capture_record and then
+	length raw frame bytes. All fields are little endian.
+*/
+
+#define CAPTURE_MAGIC "PIBUSCAP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_RX 0		/* received from another module */
+#define CAPTURE_TX 1		/* written by us */
+#define CAPTURE_ECHO 2		/* our own frame coming back from the bus */
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t realtime_usec;		/* wall clock when the session started */
+	uint64_t monotonic_usec;	/* record clock at the same moment */
+}
+capture_header;
+
+typedef struct
+{
+	uint64_t usec;		/* CLOCK_MONOTONIC */
+	uint16_t length;
+	uint8_t direction;
+	uint8_t reserved[5];
+}
+capture_record;
+
+int capture_open(const char *path);
+void capture_frame(int direction, uint64_t usec, const unsigned char *msg, int length);
+void capture_flush(void);
+unsigned int capture_dropped(void);
+void capture_close(void);
@@ -0,0 +1,172 @@
+/*
+ * dispatch-bench - check and time the ibus event index on the host
+ *
+ * Builds tables of 20, 200 and 2000 made up entries the way events[] is
+ * laid out: a few matching only the first 2 or 3 bytes, the rest 4
+ * bytes or 5 and more, with repeated keys, 4 and 5+ byte entries on the
+ * same (source, destination, command) and prefixes shadowed by earlier
+ * entries. Frames built from the entries, cut short, with a
+ * byte changed or just random all go through both the index and a
+ * linear scan, which must pick the same entry; then both are timed over
+ * the first TIMED_FRAMES of them, which hit entries all over the table.
+ * Exit status is 1 on any disagreement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ibus-dispatch.h"
+
+#define FRAMES_PER_ENTRY 8
+#define LOOKUPS 2000000
+#define TIMED_FRAMES 1024	/* the same number at every size, the cache sees no difference */
+#define FRAME_MAX 24
+
+static const unsigned char devices[] =
+{
+	0x00, 0x18, 0x3B, 0x3F, 0x44, 0x50, 0x5B, 0x60, 0x68, 0x6A,
+	0x72, 0x7F, 0x80, 0xBB, 0xBF, 0xC0, 0xC8, 0xD0, 0xE7, 0xED, 0xF0, 0xFF,
+};
+
+#define DEVICES (sizeof(devices) / sizeof(devices[0]))
+
+typedef struct
+{
+	unsigned char msg[FRAME_MAX];
+	int length;
+}
+frame;
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* entry i, some of them copying the key of an earlier one */
+static int make_entry(unsigned char *m, int i, unsigned char (*table)[FRAME_MAX], const int *lengths)
+{
+	int length, j, r = rand() % 100;
+
+	if (r < 3)
+		length = 2 + rand() % 2;
+	else if (r < 45)
+		length = 4;
+	else
+		length = 5 + rand() % 8;
+
+	m[0] = devices[rand() % DEVICES];
+	m[2] = devices[rand() % DEVICES];
+	m[3] = rand();
+	for (j = 4; j < FRAME_MAX; j++)
+		m[j] = rand() % 4;
+	m[1] = length < 5 ? 3 + rand() % 3 : length - 2;
+
+	/* a fifth of them reuse the start of an earlier entry */
+	if (i > 0 && rand() % 5 == 0)
+	{
+		j = rand() % i;
+		memcpy(m, table[j], lengths[j] < 5 ? lengths[j] : 5);
+		if (lengths[j] < 4)
+			m[3] = rand();
+	}
+
+	return length;
+}
+
+static int make_frame(frame *f, unsigned char (*table)[FRAME_MAX], const int *lengths, int count)
+{
+	int i = rand() % count;
+	int j;
+
+	memcpy(f->msg, table[i], FRAME_MAX);
+	f->length = lengths[i] + rand() % (FRAME_MAX - lengths[i] + 1);
+	for (j = lengths[i]; j < f->length; j++)
+		f->msg[j] = rand() % 4;
+
+	switch (rand() % 4)
+	{
+		case 0:	/* cut short */
+			f->length = 2 + rand() % (f->length - 1);
+			break;
+		case 1:	/* one byte off */
+			f->msg[rand() % f->length] ^= 1 << (rand() % 8);
+			break;
+		case 2:	/* nothing to do with any entry */
+			for (j = 0; j < f->length; j++)
+				f->msg[j] = rand();
+			break;
+	}
+
+	return i;
+}
+
+static int bench(int count)
+{
+	unsigned char (*table)[FRAME_MAX] = malloc(count * FRAME_MAX);
+	int *lengths = malloc(count * sizeof(int));
+	int nframes = count * FRAMES_PER_ENTRY;
+	frame *frames = malloc(nframes * sizeof(frame));
+	ibus_dispatch d;
+	int timed = nframes < TIMED_FRAMES ? nframes : TIMED_FRAMES;
+	int i, a, b, hits = 0, wrong = 0;
+	uint64_t t0, t_hash, t_linear;
+	volatile int sink = 0;
+
+	ibus_dispatch_init(&d, count);
+	for (i = 0; i < count; i++)
+	{
+		lengths[i] = make_entry(table[i], i, table, lengths);
+		ibus_dispatch_add(&d, lengths[i], table[i]);
+	}
+	for (i = 0; i < nframes; i++)
+		make_frame(&frames[i], table, lengths, count);
+
+	for (i = 0; i < nframes; i++)
+	{
+		a = ibus_dispatch_find(&d, frames[i].msg, frames[i].length);
+		b = ibus_dispatch_find_linear(&d, frames[i].msg, frames[i].length);
+		if (a != b)
+		{
+			if (wrong++ < 5)
+				fprintf(stderr, "%d entries: frame %d: index says %d, linear scan %d\n", count, i, a, b);
+		}
+		hits += b != -1;
+	}
+
+	t0 = now_nsec();
+	for (i = 0; i < LOOKUPS; i++)
+		sink += ibus_dispatch_find(&d, frames[i % timed].msg, frames[i % timed].length);
+	t_hash = now_nsec() - t0;
+
+	t0 = now_nsec();
+	for (i = 0; i < LOOKUPS; i++)
+		sink += ibus_dispatch_find_linear(&d, frames[i % timed].msg, frames[i % timed].length);
+	t_linear = now_nsec() - t0;
+
+	printf("%5d entries: %d frames, %d matched, %d disagree; index %.1f ns, linear %.1f ns per frame\n",
+		count, nframes, hits, wrong, (double) t_hash / LOOKUPS, (double) t_linear / LOOKUPS);
+
+	ibus_dispatch_free(&d);
+	free(frames);
+	free(lengths);
+	free(table);
+	return wrong;
+}
+
+int main(int argc, char *argv[])
+{
+	int wrong = 0;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	wrong += bench(20);
+	wrong += bench(200);
+	wrong += bench(2000);
+
+	return wrong ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "gpio.h"
+#include "stub.h"
+
+/* gpio backend for pibus-replay: records output changes, the bus always reads idle */
+
+static int level[32];
+
+
+int gpio_init()
+{
+	return 0;
+}
+
+void gpio_set_input(int gpio_number)
+{
+}
+
+void gpio_set_output(int gpio_number)
+{
+}
+
+int gpio_read(int gpio_number)
+{
+	return 1;
+}
+
+void gpio_write(int gpio_number, int value)
+{
+	value = value ? 1 : 0;
+
+	if (gpio_number >= 0 && gpio_number < 32 && level[gpio_number] != value)
+	{
+		level[gpio_number] = value;
+		stub_action("gpio %d=%d\n", gpio_number, value);
+	}
+}
+
+void gpio_set_pull(int gpio_number, pull_type pt)
+{
+}
+
+void gpio_cleanup()
+{
+}
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ibus-dispatch.h"
+
+/*
+	Dispatch index over a table of frame prefixes. Entries are hashed on
+	what they match: 2 byte entries on the source, 3 byte entries on
+	(source, length, destination), 4 byte entries on (source,
+	destination, command) and longer ones on (source, destination,
+	command, data0). A frame probes each key it is long enough for and
+	walks the candidates of all of them in table order, so the first
+	matching entry still wins - exactly as a linear scan would. Only
+	entries matching fewer than 2 bytes, which no real table has, are
+	on a list every frame walks.
+*/
+
+#define SOURCE 0
+#define LENGTH 1
+#define DEST 2
+#define DATA 3
+
+#define KEY3(m) ((uint64_t) ((m)[SOURCE] << 16 | (m)[DEST] << 8 | (m)[DATA]))
+#define KEY4(m) ((1ULL << 32) | KEY3(m) << 8 | (m)[DATA + 1])
+#define KEY1(m) ((2ULL << 32) | (m)[SOURCE])
+#define KEY2(m) ((4ULL << 32) | (m)[SOURCE] << 16 | (m)[LENGTH] << 8 | (m)[DEST])
+
+#define CHAINS 5
+
+static ibus_dispatch_slot *ibus_dispatch_slot_for(const ibus_dispatch *d, uint64_t key)
+{
+	unsigned int h;
+
+	h = (unsigned int) (key ^ (key >> 17) ^ (key >> 29)) * 2654435761U;
+	h &= d->hash_size - 1;
+
+	while (d->hash[h].first != -1 && d->hash[h].key != key)
+	{
+		h = (h + 1) & (d->hash_size - 1);
+	}
+
+	return &d->hash[h];
+}
+
+static int ibus_dispatch_chain(const ibus_dispatch *d, uint64_t key)
+{
+	return ibus_dispatch_slot_for(d, key)->first;
+}
+
+/* room for size entries, added in table order with ibus_dispatch_add() */
+
+void ibus_dispatch_init(ibus_dispatch *d, int size)
+{
+	int i;
+
+	d->count = 0;
+	d->size = size;
+	d->match_length = malloc(size * sizeof(int));
+	d->match = malloc(size * sizeof(const unsigned char *));
+	d->next = malloc(size * sizeof(int));
+	d->tiny_first = -1;
+	d->tiny_last = -1;
+
+	/* at most half full, so probe chains stay short */
+	d->hash_size = 16;
+	while (d->hash_size < size * 2)
+	{
+		d->hash_size *= 2;
+	}
+
+	d->hash = malloc(d->hash_size * sizeof(ibus_dispatch_slot));
+	for (i = 0; i < d->hash_size; i++)
+	{
+		d->hash[i].first = -1;
+	}
+}
+
+void ibus_dispatch_add(ibus_dispatch *d, int match_length, const unsigned char *match)
+{
+	ibus_dispatch_slot *slot;
+	uint64_t key;
+	int i;
+
+	if (d->count == d->size)
+	{
+		return;
+	}
+
+	i = d->count++;
+	d->match_length[i] = match_length;
+	d->match[i] = match;
+	d->next[i] = -1;
+
+	if (match_length < 2)
+	{
+		if (d->tiny_last == -1)
+			d->tiny_first = i;
+		else
+			d->next[d->tiny_last] = i;
+		d->tiny_last = i;
+		return;
+	}
+
+	switch (match_length)
+	{
+		case 2:
+			key = KEY1(match);
+			break;
+		case 3:
+			key = KEY2(match);
+			break;
+		case 4:
+			key = KEY3(match);
+			break;
+		default:
+			key = KEY4(match);
+			break;
+	}
+	slot = ibus_dispatch_slot_for(d, key);
+	if (slot->first == -1)
+	{
+		slot->key = key;
+		slot->first = i;
+	}
+	else
+	{
+		d->next[slot->last] = i;
+	}
+	slot->last = i;
+}
+
+/* index of the first entry that is a prefix of msg, -1 if none */
+
+int ibus_dispatch_find(const ibus_dispatch *d, const unsigned char *msg, int length)
+{
+	int chain[CHAINS];
+	int n = 0;
+	int i, k, first;
+
+	/* the candidate chains this frame can match, heads in table order */
+	chain[n++] = d->tiny_first;
+	if (length >= 2)
+		chain[n++] = ibus_dispatch_chain(d, KEY1(msg));
+	if (length >= 3)
+		chain[n++] = ibus_dispatch_chain(d, KEY2(msg));
+	if (length >= 4)
+		chain[n++] = ibus_dispatch_chain(d, KEY3(msg));
+	if (length >= 5)
+		chain[n++] = ibus_dispatch_chain(d, KEY4(msg));
+
+	for (k = 0; k < n; k++)
+	{
+		if (chain[k] == -1)
+			chain[k--] = chain[--n];
+	}
+
+	/* merge them by table index */
+	while (n > 0)
+	{
+		first = 0;
+		for (k = 1; k < n; k++)
+		{
+			if (chain[k] < chain[first])
+				first = k;
+		}
+
+		i = chain[first];
+		chain[first] = d->next[i];
+		if (chain[first] == -1)
+			chain[first] = chain[--n];
+
+		if (d->match_length[i] <= length && memcmp(msg, d->match[i], d->match_length[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* the same by walking the whole table, what the index has to agree with */
+
+int ibus_dispatch_find_linear(const ibus_dispatch *d, const unsigned char *msg, int length)
+{
+	int i;
+
+	for (i = 0; i < d->count; i++)
+	{
+		if (d->match_length[i] <= length && memcmp(msg, d->match[i], d->match_length[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void ibus_dispatch_free(ibus_dispatch *d)
+{
+	free(d->match_length);
+	free(d->match);
+	free(d->next);
+	free(d->hash);
+	d->count = d->size = 0;
+}
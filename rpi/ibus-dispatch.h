@@ -0,0 +1,27 @@
+typedef struct
+{
+	uint64_t key;
+	int first;		/* entry index, -1 = empty slot */
+	int last;
+}
+ibus_dispatch_slot;
+
+typedef struct
+{
+	int count;		/* entries added */
+	int size;		/* entries there is room for */
+	int *match_length;
+	const unsigned char **match;
+	int *next;		/* next candidate with the same key */
+	int tiny_first;		/* entries matching < 2 bytes */
+	int tiny_last;
+	ibus_dispatch_slot *hash;
+	int hash_size;
+}
+ibus_dispatch;
+
+void ibus_dispatch_init(ibus_dispatch *d, int size);
+void ibus_dispatch_add(ibus_dispatch *d, int match_length, const unsigned char *match);
+int ibus_dispatch_find(const ibus_dispatch *d, const unsigned char *msg, int length);
+int ibus_dispatch_find_linear(const ibus_dispatch *d, const unsigned char *msg, int length);
+void ibus_dispatch_free(ibus_dispatch *d);
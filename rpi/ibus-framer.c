@@ -0,0 +1,311 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "mainloop.h"
+#include "ibus-framer.h"
+
+/*
+	Incremental I-Bus framer. Bytes are read from the tty straight into
+	buf in large chunks, frames are cut out of it with a running xor and
+	handed to the handler as a pointer into buf, without copying. The
+	partial frame at the end is moved to the front only when buf runs
+	out of space.
+
+	A frame with a bad checksum means we lost sync (corrupt length byte,
+	started listening mid-frame). Rather than waiting for the bus to go
+	quiet, slide forward one byte at a time and only accept a start that
+	looks like a real header and whose frame checks out. A start whose
+	length byte claims more than has arrived is dropped as soon as a good
+	frame is complete behind it, instead of swallowing everything up to
+	the next gap.
+*/
+
+#define SOURCE 0
+#define LENGTH 1
+#define DEST 2
+
+#define GAP_USEC 64000		/* silence that ends a partial frame */
+
+/* known I-Bus device addresses, one bit each */
+static const uint32_t known_addr[8] =
+{
+	/* 00 GM, 08 SHD, 18 CDC */
+	(1 << 0x00) | (1 << 0x08) | (1 << 0x18),
+	/* 24 HKM, 28 FUH, 30 CCM, 3B GT, 3F DIA */
+	(1 << (0x24 - 32)) | (1 << (0x28 - 32)) | (1 << (0x30 - 32)) | (1 << (0x3B - 32)) | (1 << (0x3F - 32)),
+	/* 40 FBZV, 43 GTF, 44 EWS, 46 CID, 47 FMBT, 50 MFL, 51 MM0, 5B IHK */
+	(1 << (0x40 - 64)) | (1 << (0x43 - 64)) | (1 << (0x44 - 64)) | (1 << (0x46 - 64)) | (1 << (0x47 - 64)) |
+	(1 << (0x50 - 64)) | (1 << (0x51 - 64)) | (1 << (0x5B - 64)),
+	/* 60 PDC, 68 RAD, 6A DSP, 72 SM0, 73 SDRS, 76 CDCD, 7F NAVE */
+	(1 << (0x60 - 96)) | (1 << (0x68 - 96)) | (1 << (0x6A - 96)) | (1 << (0x72 - 96)) | (1 << (0x73 - 96)) |
+	(1 << (0x76 - 96)) | (1U << (0x7F - 96)),
+	/* 80 IKE, 9B MM1, 9C MM2 */
+	(1 << (0x80 - 128)) | (1 << (0x9B - 128)) | (1 << (0x9C - 128)),
+	/* A0 FMID, A4 ABM, A7 FID, A8 FHK, B0 SES, BB NAVJ, BF GLO */
+	(1 << (0xA0 - 160)) | (1 << (0xA4 - 160)) | (1 << (0xA7 - 160)) | (1 << (0xA8 - 160)) | (1 << (0xB0 - 160)) |
+	(1 << (0xBB - 160)) | (1U << (0xBF - 160)),
+	/* C0 MID, C8 TEL, D0 LCM, D7/D8 PiBUS ATtiny */
+	(1 << (0xC0 - 192)) | (1 << (0xC8 - 192)) | (1 << (0xD0 - 192)) | (1 << (0xD7 - 192)) | (1 << (0xD8 - 192)),
+	/* E0 IRIS, E7 ANZV, E8 RLS, ED TV, F0 BMBT, F5 SZM, FF LOC */
+	(1 << (0xE0 - 224)) | (1 << (0xE7 - 224)) | (1 << (0xE8 - 224)) | (1 << (0xED - 224)) | (1 << (0xF0 - 224)) |
+	(1 << (0xF5 - 224)) | (1U << (0xFF - 224)),
+};
+
+static bool is_known_addr(unsigned char addr)
+{
+	return (known_addr[addr >> 5] >> (addr & 31)) & 1;
+}
+
+/* enough of the header to be worth waiting for the rest of the frame? */
+static bool ibus_framer_plausible(const ibus_framer *f)
+{
+	const unsigned char *p = f->buf + f->start;
+	int have = f->end - f->start;
+
+	if (!is_known_addr(p[SOURCE]))
+		return FALSE;
+	if (have > LENGTH && p[LENGTH] < 3)
+		return FALSE;
+	if (have > DEST && !is_known_addr(p[DEST]))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+	The counters are written only here, on the rx thread when there is
+	one, and read from the main thread. Single writer, so a relaxed
+	store of the new value is enough to keep the reads whole.
+*/
+#define FRAMER_COUNT(c, n) __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+
+static void ibus_framer_discard(ibus_framer *f)
+{
+	f->start++;
+	f->scan = f->start;
+	f->sum = 0;
+	FRAMER_COUNT(f->discarded, 1);
+	f->recovering++;
+}
+
+static void ibus_framer_synced(ibus_framer *f)
+{
+	if (f->resyncing)
+	{
+		if (f->recovering > f->max_recovery)
+		{
+			__atomic_store_n(&f->max_recovery, f->recovering, __ATOMIC_RELAXED);
+		}
+		f->resyncing = FALSE;
+	}
+}
+
+
+/*
+	The frame at start isn't complete yet. If a plausible frame that
+	checks out is already complete further on, the length byte at start
+	is wrong (corrupt, or we started listening mid-frame). Returns how
+	many bytes to skip to get to that frame, 0 to keep waiting.
+*/
+static int ibus_framer_lookahead(const ibus_framer *f)
+{
+	const unsigned char *p;
+	unsigned char sum;
+	int k, i, len;
+
+	for (k = f->start + 1; k + DEST < f->end; k++)
+	{
+		p = f->buf + k;
+		if (!is_known_addr(p[SOURCE]) || p[LENGTH] < 3 || !is_known_addr(p[DEST]))
+			continue;
+
+		len = p[LENGTH] + 2;
+		if (k + len > f->end)
+			continue;
+
+		sum = 0;
+		for (i = 0; i < len; i++)
+		{
+			sum ^= p[i];
+		}
+		if (sum == 0)
+			return k - f->start;
+	}
+
+	return 0;
+}
+
+void ibus_framer_init(ibus_framer *f)
+{
+	f->start = 0;
+	f->scan = 0;
+	f->end = 0;
+	f->sum = 0;
+	f->last_byte = 0;
+	f->frame_start = 0;
+	f->resyncing = FALSE;
+	f->recovering = 0;
+	f->frames = 0;
+	f->corrupt = 0;
+	f->resyncs = 0;
+	f->discarded = 0;
+	f->max_recovery = 0;
+}
+
+/* where the next read() should go, always room for at least one frame */
+
+unsigned char *ibus_framer_space(ibus_framer *f, int *avail)
+{
+	if (IBUS_FRAMER_BUF - f->end < IBUS_FRAME_MAX)
+	{
+		memmove(f->buf, f->buf + f->start, f->end - f->start);
+		f->end -= f->start;
+		f->scan -= f->start;
+		f->start = 0;
+	}
+
+	*avail = IBUS_FRAMER_BUF - f->end;
+	return f->buf + f->end;
+}
+
+/* length new bytes were placed at ibus_framer_space(), all received at usec */
+
+void ibus_framer_commit(ibus_framer *f, int length, uint64_t usec, ibus_frame_func func)
+{
+	int frame_len;
+	int skip;
+
+	if (length <= 0)
+	{
+		return;
+	}
+
+	if (f->start != f->end && usec - f->last_byte > GAP_USEC)
+	{
+		/* bus went quiet in the middle of a frame, drop what we have */
+		FRAMER_COUNT(f->discarded, f->end - f->start);
+		f->recovering += f->end - f->start;
+		f->start = f->end;
+		f->scan = f->end;
+		f->sum = 0;
+	}
+
+	if (f->start == f->end)
+	{
+		/* after a gap the next byte starts a frame */
+		ibus_framer_synced(f);
+	}
+
+	if (f->start == f->end)
+	{
+		f->frame_start = usec;
+	}
+
+	f->end += length;
+	f->last_byte = usec;
+
+	while (f->end - f->start >= 1)
+	{
+		if (f->resyncing && !ibus_framer_plausible(f))
+		{
+			ibus_framer_discard(f);
+			continue;
+		}
+
+		if (f->end - f->start < 2)
+		{
+			break;
+		}
+
+		/* a frame carries at least destination and checksum */
+		if (f->buf[f->start + LENGTH] < 2)
+		{
+			ibus_framer_discard(f);
+			continue;
+		}
+
+		frame_len = f->buf[f->start + LENGTH] + 2;
+		while (f->scan < f->end && f->scan < f->start + frame_len)
+		{
+			f->sum ^= f->buf[f->scan++];
+		}
+
+		if (f->scan < f->start + frame_len)
+		{
+			skip = ibus_framer_lookahead(f);
+			if (skip == 0)
+			{
+				break;
+			}
+		}
+		else
+		{
+			/* xor over the whole frame, checksum included, is zero */
+			skip = f->sum != 0;
+		}
+
+		if (skip)
+		{
+			FRAMER_COUNT(f->corrupt, 1);
+			if (!f->resyncing)
+			{
+				f->resyncing = TRUE;
+				f->recovering = 0;
+				FRAMER_COUNT(f->resyncs, 1);
+			}
+			while (skip-- > 0)
+			{
+				ibus_framer_discard(f);
+			}
+			continue;
+		}
+
+		ibus_framer_synced(f);
+		FRAMER_COUNT(f->frames, 1);
+
+		func(f->buf + f->start, frame_len, f->frame_start);
+
+		f->start += frame_len;
+		f->scan = f->start;
+		f->sum = 0;
+		f->frame_start = usec;
+	}
+
+	if (f->start == f->end)
+	{
+		f->start = f->end = f->scan = 0;
+	}
+}
+
+/* for callers that don't read() into the framer */
+
+void ibus_framer_feed(ibus_framer *f, const unsigned char *data, int length, uint64_t usec, ibus_frame_func func)
+{
+	unsigned char *space;
+	int avail;
+	int n;
+
+	while (length > 0)
+	{
+		space = ibus_framer_space(f, &avail);
+		n = length < avail ? length : avail;
+		memcpy(space, data, n);
+		ibus_framer_commit(f, n, usec, func);
+		data += n;
+		length -= n;
+	}
+}
+
+int ibus_framer_pending(const ibus_framer *f)
+{
+	return f->end - f->start;
+}
+
+void ibus_framer_get_stats(const ibus_framer *f, unsigned int *frames, unsigned int *corrupt, unsigned int *resyncs, unsigned int *discarded, unsigned int *max_recovery)
+{
+	*frames = __atomic_load_n(&f->frames, __ATOMIC_RELAXED);
+	*corrupt = __atomic_load_n(&f->corrupt, __ATOMIC_RELAXED);
+	*resyncs = __atomic_load_n(&f->resyncs, __ATOMIC_RELAXED);
+	*discarded = __atomic_load_n(&f->discarded, __ATOMIC_RELAXED);
+	*max_recovery = __atomic_load_n(&f->max_recovery, __ATOMIC_RELAXED);
+}
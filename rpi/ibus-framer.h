@@ -0,0 +1,33 @@
+/* largest frame: source + length byte + up to 255 bytes counted by it */
+#define IBUS_FRAME_MAX 257
+#define IBUS_FRAMER_BUF 4096
+
+typedef void (*ibus_frame_func) (const unsigned char *msg, int length, uint64_t usec);
+
+typedef struct
+{
+	unsigned char buf[IBUS_FRAMER_BUF];
+	int start;		/* first byte of the frame being assembled */
+	int scan;		/* bytes before this are folded into sum */
+	int end;		/* end of valid data */
+	unsigned char sum;	/* running xor of buf[start..scan) */
+	uint64_t last_byte;	/* microseconds */
+	uint64_t frame_start;	/* microseconds */
+
+	bool resyncing;		/* lost sync, sliding to the next good frame */
+	unsigned int recovering;	/* bytes discarded in the current resync */
+
+	unsigned int frames;
+	unsigned int corrupt;		/* frames with a bad checksum */
+	unsigned int resyncs;		/* times sync was lost */
+	unsigned int discarded;		/* bytes not part of any good frame */
+	unsigned int max_recovery;	/* most bytes discarded by one resync */
+}
+ibus_framer;
+
+void ibus_framer_init(ibus_framer *f);
+unsigned char *ibus_framer_space(ibus_framer *f, int *avail);
+void ibus_framer_commit(ibus_framer *f, int length, uint64_t usec, ibus_frame_func func);
+void ibus_framer_feed(ibus_framer *f, const unsigned char *data, int length, uint64_t usec, ibus_frame_func func);
+int ibus_framer_pending(const ibus_framer *f);
+void ibus_framer_get_stats(const ibus_framer *f, unsigned int *frames, unsigned int *corrupt, unsigned int *resyncs, unsigned int *discarded, unsigned int *max_recovery);
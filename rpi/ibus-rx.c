@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "mainloop.h"
+#include "ibus-rx.h"
+
+/*
+	Optional real-time receive path. The byte framer runs on its own
+	SCHED_FIFO thread, so slow work on the mainloop (uinput, log writes,
+	system() calls) can't delay reading the UART. Completed frames are
+	handed over through a single-producer/single-consumer ring and an
+	eventfd wakes the mainloop.
+*/
+
+#define RX_RING_SIZE 64		/* power of 2 */
+#define RX_PRIORITY 50
+
+typedef struct
+{
+	uint64_t usec;
+	int length;
+	unsigned char msg[IBUS_RX_FRAME_MAX];
+}
+rx_frame;
+
+static struct
+{
+	rx_frame ring[RX_RING_SIZE];
+	unsigned int head;	/* written by the rx thread only */
+	unsigned int tail;	/* written by the mainloop only */
+
+	int fd;
+	int efd;
+	bool running;
+	ibus_rx_reader reader;
+	ibus_rx_handler handler;
+	pthread_t thread;
+
+	int high_water;
+	unsigned int dropped;
+}
+rx =
+{
+	.head = 0,
+	.tail = 0,
+	.fd = -1,
+	.efd = -1,
+	.running = FALSE,
+	.high_water = 0,
+	.dropped = 0,
+};
+
+
+/* rx thread: queue a complete frame for the mainloop */
+
+bool ibus_rx_push(const unsigned char *msg, int length, uint64_t usec)
+{
+	unsigned int head = rx.head;
+	unsigned int tail = __atomic_load_n(&rx.tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	rx_frame *f;
+	int used;
+
+	if (head - tail >= RX_RING_SIZE || length > IBUS_RX_FRAME_MAX)
+	{
+		__atomic_add_fetch(&rx.dropped, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+
+	f = &rx.ring[head & (RX_RING_SIZE - 1)];
+	memcpy(f->msg, msg, length);
+	f->length = length;
+	f->usec = usec;
+
+	__atomic_store_n(&rx.head, head + 1, __ATOMIC_RELEASE);
+
+	used = head + 1 - tail;
+	if (used > rx.high_water)
+	{
+		__atomic_store_n(&rx.high_water, used, __ATOMIC_RELAXED);
+	}
+
+	write(rx.efd, &one, sizeof(one));
+
+	return TRUE;
+}
+
+/* mainloop: drain the ring */
+
+static void ibus_rx_wakeup(int condition, void *unused)
+{
+	uint64_t count;
+	unsigned int head;
+	rx_frame *f;
+
+	read(rx.efd, &count, sizeof(count));
+
+	head = __atomic_load_n(&rx.head, __ATOMIC_ACQUIRE);
+	while (rx.tail != head)
+	{
+		f = &rx.ring[rx.tail & (RX_RING_SIZE - 1)];
+		rx.handler(f->msg, f->length, f->usec);
+		__atomic_store_n(&rx.tail, rx.tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void *ibus_rx_thread(void *unused)
+{
+	struct pollfd pfd;
+
+	pfd.fd = rx.fd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		if (poll(&pfd, 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		rx.reader(FIA_READ, NULL);
+	}
+
+	return NULL;
+}
+
+int ibus_rx_start(int fd, int cpu, ibus_rx_reader reader, ibus_rx_handler handler)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+
+	rx.fd = fd;
+	rx.reader = reader;
+	rx.handler = handler;
+
+	rx.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rx.efd == -1)
+	{
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+
+	if (cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = RX_PRIORITY;
+	pthread_attr_setschedparam(&attr, &param);
+
+	/* the framer checks this to decide between queueing and handling inline */
+	rx.running = TRUE;
+
+	if (pthread_create(&rx.thread, &attr, ibus_rx_thread, NULL) != 0)
+	{
+		/* not allowed to use SCHED_FIFO? run it as a normal thread */
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		if (pthread_create(&rx.thread, &attr, ibus_rx_thread, NULL) != 0)
+		{
+			pthread_attr_destroy(&attr);
+			rx.running = FALSE;
+			close(rx.efd);
+			rx.efd = -1;
+			return -2;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	/* frames queued before this are still counted in the eventfd */
+	mainloop_input_add(rx.efd, FIA_READ, ibus_rx_wakeup, NULL);
+
+	return 0;
+}
+
+bool ibus_rx_threaded(void)
+{
+	return rx.running;
+}
+
+void ibus_rx_stats(int *high_water, unsigned int *dropped)
+{
+	*high_water = __atomic_load_n(&rx.high_water, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&rx.dropped, __ATOMIC_RELAXED);
+}
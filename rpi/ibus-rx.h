@@ -0,0 +1,10 @@
+/* largest frame: source + length byte + up to 255 bytes counted by it */
+#define IBUS_RX_FRAME_MAX 257
+
+typedef void (*ibus_rx_reader) (int condition, void *user_data);
+typedef void (*ibus_rx_handler) (const unsigned char *msg, int length, uint64_t usec);
+
+int ibus_rx_start(int fd, int cpu, ibus_rx_reader reader, ibus_rx_handler handler);
+bool ibus_rx_threaded(void);
+bool ibus_rx_push(const unsigned char *msg, int length, uint64_t usec);
+void ibus_rx_stats(int *high_water, unsigned int *dropped);
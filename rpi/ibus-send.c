@@ -9,113 +9,703 @@
 #include "mainloop.h"
 #include "ibus.h"
 #include "ibus-send.h"
-#include "slist.h"
+#include "capture.h"
+#include "ibus-framer.h"
 
+#define DEST 2
 
-extern FILE *flog;
+/*
+	Outgoing frames live in a pool of TXQ_SLOTS preallocated slots and
+	wait in one FIFO per priority class until their echo comes back from
+	the bus. Each class has a deadline; a frame still queued past it is
+	stale and expires, so a reply nobody is waiting for anymore never
+	holds up the bus. The scheduler sends the first frame that is due,
+	looking at the head of each class from the most urgent down, so a
+	stuck announcement cannot block a poll reply. Queued frames are also
+	hashed on (length, checksum, source, destination, command) so each
+	received frame is matched against the queue in O(1). When every slot
+	is taken the oldest frame of the least urgent class, no more urgent
+	than the new one, is dropped to make room; if there is none the new
+	frame is dropped.
 
-static SList *pkt_list = NULL;
+	A frame that doesn't echo back is sent again after the retransmit
+	timeout, derived like TCP's RTO from the measured write-to-echo time
+	(smoothed RTT plus four times its mean deviation). Only frames sent
+	once give a sample, since the echo of a retransmitted frame can't be
+	told apart from a late echo of the first copy. The timeout doubles
+	with every retransmit up to TXQ_RTO_MAX, and after max_retries the
+	frame is given up and reported to the failure callback. The class
+	deadline bounds all of that: where the backed-off timeouts would run
+	past it, the retries left are spread evenly over the time left, so
+	the last one still gets its echo time before the deadline and every
+	class gets its max_retries.
 
+	Our share of the bus is capped by token buckets, one per class and
+	one for the total, refilled at a configured rate in bytes/s and
+	holding up to a second's worth. A frame goes out only when its
+	class bucket and the total both hold its length; until then it
+	stays queued, and best-effort frames that wait past their deadline
+	expire. Urgent frames only answer to their own bucket, but what they
+	send is charged to the total, so a burst of replies pushes the rest
+	back instead of the other way round.
+*/
 
+#define TXQ_SLOTS 16
+#define TXQ_HASH 32		/* power of two */
+
+#define TXQ_RTO_INITIAL 1400000	/* usec, until there is a sample */
+#define TXQ_RTO_MIN 100000
+#define TXQ_RTO_MAX 3000000
+#define TXQ_RETRIES 5
+#define TXQ_RETRIES_MAX 10	/* the most ibus_set_tx_retries() takes */
+
+#define TXQ_BUDGET_TOTAL 240	/* bytes/s, about a quarter of the bus */
+#define TXQ_BUDGET_LOW 60
 
 typedef struct
 {
-	unsigned char msg[32];
+	unsigned char msg[IBUS_FRAME_MAX];
 	int length;
-	int countdown;
+	uint64_t due;		/* usec, (re)send from then on */
+	uint64_t sent_usec;	/* last write */
+	uint64_t queued;	/* usec */
+	uint64_t expires;	/* usec, class deadline */
+	int retries;		/* retransmits so far */
+	int prio;
+	bool sent;
+	bool deferred;		/* held back by the budget at least once */
+	unsigned char next;		/* slot + 1 in the class FIFO or free list */
+	unsigned char hash_next;	/* slot + 1, 0 ends the chain */
 }
 packet;
 
+typedef struct
+{
+	int rate;		/* bytes/s, 0 = unlimited */
+	int64_t credit;		/* millionths of a byte, may go negative */
+	uint64_t last;		/* usec of the last refill */
+}
+txq_budget;
+
+/* usec a frame may wait for its echo, per class */
+static const uint64_t txq_deadline[IBUS_PRIO_LEVELS] =
+{
+	[IBUS_PRIO_URGENT] = 2000000,	/* the radio asks again */
+	[IBUS_PRIO_NORMAL] = 10000000,
+	[IBUS_PRIO_LOW] = 5000000,	/* well inside their repeat interval */
+};
+
+static struct
+{
+	packet slot[TXQ_SLOTS];
+	unsigned char head[IBUS_PRIO_LEVELS];	/* slot + 1, 0 = empty */
+	unsigned char tail[IBUS_PRIO_LEVELS];
+	unsigned char free;
+	int count;
+	bool initialized;
+	unsigned char hash[TXQ_HASH];	/* slot + 1, 0 = empty */
+
+	uint64_t rto;		/* usec */
+	int max_retries;
+	ibus_tx_failed_func failed;
+	ibus_tx_wakeup_func wakeup;
+	unsigned char last_sent;	/* slot + 1 of the last frame written */
+	int tag;		/* expiry timer, -1 = none */
+	txq_budget budget[IBUS_PRIO_LEVELS + 1];	/* per class, then total */
+
+	ibus_queue_stats stats;
+	ibus_dest_stats dest[256];
+}
+txq =
+{
+	.rto = TXQ_RTO_INITIAL,
+	.max_retries = TXQ_RETRIES,
+	.failed = NULL,
+	.wakeup = NULL,
+	.tag = -1,
+	.budget =
+	{
+		[IBUS_PRIO_LOW] = { .rate = TXQ_BUDGET_LOW },
+		[IBUS_BUDGET_TOTAL] = { .rate = TXQ_BUDGET_TOTAL },
+	},
+};
+
+
+
+static unsigned int ibus_queue_hash(const unsigned char *msg, int length)
+{
+	return (length * 31 ^ msg[length - 1] * 7 ^ msg[0] << 3 ^ msg[2] << 5 ^ msg[3]) & (TXQ_HASH - 1);
+}
+
+static void ibus_queue_init(void)
+{
+	int i;
+
+	for (i = 0; i < TXQ_SLOTS; i++)
+	{
+		txq.slot[i].next = i + 2 <= TXQ_SLOTS ? i + 2 : 0;
+	}
+	txq.free = 1;
+	txq.initialized = TRUE;
+}
+
+static int64_t ibus_budget_cap(const txq_budget *b)
+{
+	return (int64_t) b->rate * 1000000;
+}
+
+/* usec until the bucket holds length bytes, or is full, 0 = now */
+
+static uint64_t ibus_budget_wait(txq_budget *b, int length, uint64_t now)
+{
+	int64_t need;
+
+	if (b->rate == 0)
+	{
+		return 0;
+	}
+
+	if (b->last == 0)
+	{
+		/* start with a full bucket */
+		b->credit = ibus_budget_cap(b);
+		b->last = now;
+	}
+	else if (now > b->last)
+	{
+		b->credit += (int64_t) (now - b->last) * b->rate;
+		if (b->credit > ibus_budget_cap(b))
+		{
+			b->credit = ibus_budget_cap(b);
+		}
+		b->last = now;
+	}
+
+	/* a frame bigger than the bucket goes once it is full */
+	need = (int64_t) length * 1000000;
+	if (need > ibus_budget_cap(b))
+	{
+		need = ibus_budget_cap(b);
+	}
+	need -= b->credit;
 
+	return need > 0 ? (need + b->rate - 1) / b->rate : 0;
+}
 
-/* called every 50ms */
+/* the earliest time the budget lets a frame of this class go */
 
-void ibus_service_queue(int ifd, bool can_send, int gpio_number)
+static uint64_t ibus_budget_ready(int prio, int length, uint64_t now)
 {
-	SList *list;
+	uint64_t wait, total;
+
+	wait = ibus_budget_wait(&txq.budget[prio], length, now);
+	if (prio != IBUS_PRIO_URGENT)
+	{
+		total = ibus_budget_wait(&txq.budget[IBUS_BUDGET_TOTAL], length, now);
+		if (total > wait)
+		{
+			wait = total;
+		}
+	}
+
+	return now + wait;
+}
+
+static void ibus_budget_charge(int prio, int length)
+{
+	txq_budget *b;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		b = &txq.budget[i == 0 ? prio : IBUS_BUDGET_TOTAL];
+		if (b->rate == 0)
+		{
+			continue;
+		}
+		b->credit -= (int64_t) length * 1000000;
+		if (b->credit < -ibus_budget_cap(b))
+		{
+			b->credit = -ibus_budget_cap(b);
+		}
+	}
+	txq.stats.bytes[prio] += length;
+}
+
+static void ibus_rtt_sample(uint64_t rtt)
+{
+	uint64_t delta;
+
+	if (txq.stats.srtt == 0)
+	{
+		txq.stats.srtt = rtt;
+		txq.stats.rttvar = rtt / 2;
+	}
+	else
+	{
+		delta = rtt > txq.stats.srtt ? rtt - txq.stats.srtt : txq.stats.srtt - rtt;
+		txq.stats.rttvar = (3 * txq.stats.rttvar + delta) / 4;
+		txq.stats.srtt = (7 * txq.stats.srtt + rtt) / 8;
+	}
+
+	txq.rto = txq.stats.srtt + 4 * txq.stats.rttvar;
+	if (txq.rto < TXQ_RTO_MIN)
+	{
+		txq.rto = TXQ_RTO_MIN;
+	}
+	else if (txq.rto > TXQ_RTO_MAX)
+	{
+		txq.rto = TXQ_RTO_MAX;
+	}
+	txq.stats.rto = txq.rto;
+}
+
+static void ibus_free_slot(int s)
+{
+	packet *pkt = &txq.slot[s];
+	unsigned char *link, prev = 0;
+
+	link = &txq.hash[ibus_queue_hash(pkt->msg, pkt->length)];
+	while (*link != s + 1)
+	{
+		link = &txq.slot[*link - 1].hash_next;
+	}
+	*link = pkt->hash_next;
+
+	link = &txq.head[pkt->prio];
+	while (*link != s + 1)
+	{
+		prev = *link;
+		link = &txq.slot[*link - 1].next;
+	}
+	*link = pkt->next;
+	if (txq.last_sent == s + 1)
+	{
+		txq.last_sent = 0;
+	}
+	if (txq.tail[pkt->prio] == s + 1)
+	{
+		txq.tail[pkt->prio] = prev;
+	}
+
+	pkt->next = txq.free;
+	txq.free = s + 1;
+	txq.count--;
+}
+
+static void ibus_give_up(int s, int reason)
+{
+	packet *pkt = &txq.slot[s];
+
+	txq.dest[pkt->msg[DEST]].failed++;
+	if (txq.failed)
+	{
+		txq.failed(pkt->msg, pkt->length, reason);
+	}
+	ibus_free_slot(s);
+}
+
+/*
+	Class deadlines and retransmit give-ups. A timer is kept at the
+	earliest of these, and the transmit gate checks them too before it
+	takes a frame, so it never resends one that is done.
+*/
+
+static void ibus_queue_expire(uint64_t now)
+{
+	unsigned char s, next;
 	packet *pkt;
+	int prio;
 
-	list = pkt_list;
-	while (list)
+	for (prio = 0; prio < IBUS_PRIO_LEVELS; prio++)
 	{
-		pkt = list->data;
-		if (pkt->countdown)
+		for (s = txq.head[prio]; s; s = next)
 		{
-			pkt->countdown--;
+			pkt = &txq.slot[s - 1];
+			next = pkt->next;
+
+			if (pkt->sent && now >= pkt->due && pkt->retries >= txq.max_retries)
+			{
+				ibus_log("ibus_queue_expire(%d): %02x %02x %02x no echo after %d retries\n",
+					pkt->length, pkt->msg[0], pkt->msg[1], pkt->msg[2], pkt->retries);
+				txq.stats.failed++;
+				ibus_give_up(s - 1, IBUS_TX_RETRIES);
+				continue;
+			}
+
+			if (now >= pkt->expires)
+			{
+				ibus_log("ibus_queue_expire(%d): %02x %02x %02x expired\n",
+					pkt->length, pkt->msg[0], pkt->msg[1], pkt->msg[2]);
+				txq.stats.expired++;
+				ibus_give_up(s - 1, IBUS_TX_EXPIRED);
+			}
 		}
-		list = list->next;
 	}
+}
+
+static int ibus_queue_timer(void *unused);
 
-	if (!can_send)
+/* (re)arm the expiry timer for the earliest deadline in the queue */
+
+static void ibus_queue_arm(void)
+{
+	uint64_t at = 0, now;
+	packet *pkt;
+	unsigned char s;
+	int prio;
+
+	for (prio = 0; prio < IBUS_PRIO_LEVELS; prio++)
 	{
-		return;
+		for (s = txq.head[prio]; s; s = pkt->next)
+		{
+			pkt = &txq.slot[s - 1];
+			if (at == 0 || pkt->expires < at)
+			{
+				at = pkt->expires;
+			}
+			if (pkt->sent && pkt->retries >= txq.max_retries && pkt->due < at)
+			{
+				at = pkt->due;
+			}
+		}
 	}
 
-	/* Only send if GPIO 15 (UART RX) is high (idle state) */
-	if (pkt_list && !gpio_read(15))
+	if (txq.tag != -1)
 	{
-		ibus_log("ibus_service_queue(): ibus/gpio busy - waiting\n");
-		return;
+		mainloop_timeout_remove(txq.tag);
+		txq.tag = -1;
 	}
+	if (at)
+	{
+		now = mainloop_get_usec();
+		txq.tag = mainloop_timeout_add_usec(at > now ? at - now : 0, ibus_queue_timer, NULL);
+	}
+}
 
-	list = pkt_list;
-	while (list)
+static int ibus_queue_timer(void *unused)
+{
+	txq.tag = -1;
+	ibus_queue_expire(mainloop_get_usec());
+	ibus_queue_arm();
+
+	return 0;
+}
+
+/*
+	Picks the most urgent frame that is due and books it as written at
+	now. The transmit gate puts it on the wire, in one go or byte by
+	byte.
+*/
+
+const unsigned char *ibus_queue_take(uint64_t now, int *length)
+{
+	packet *pkt;
+	uint64_t rto, spread;
+	int prio, left;
+
+	ibus_queue_expire(now);
+
+	/* Only process the first item of the most urgent class that has one due */
+	for (prio = 0; prio < IBUS_PRIO_LEVELS; prio++)
 	{
-		pkt = list->data;
-		if (pkt->countdown == 0)
+		if (txq.head[prio] == 0)
+		{
+			continue;
+		}
+
+		pkt = &txq.slot[txq.head[prio] - 1];
+		if (now < pkt->due)
+		{
+			continue;
+		}
+
+		if (ibus_budget_ready(prio, pkt->length, now) > now)
+		{
+			if (!pkt->deferred)
+			{
+				pkt->deferred = TRUE;
+				txq.stats.deferred[prio]++;
+			}
+			continue;
+		}
+
+		if (ibus_log_text())
+		{
+			ibus_log("ibus_queue_take(%d): ", pkt->length);
+			ibus_dump_hex(pkt->msg, pkt->length, FALSE);
+		}
+		if (pkt->sent)
+		{
+			pkt->retries++;
+			txq.stats.retransmitted++;
+			txq.dest[pkt->msg[DEST]].retransmitted++;
+		}
+		else
+		{
+			/* time from ibus_send() to the wire */
+			txq.stats.first_sends++;
+			txq.stats.wait_total += now - pkt->queued;
+			if (now - pkt->queued > txq.stats.wait_max)
+			{
+				txq.stats.wait_max = now - pkt->queued;
+			}
+		}
+		txq.dest[pkt->msg[DEST]].sent++;
+		ibus_budget_charge(prio, pkt->length);
+		capture_frame(CAPTURE_TX, now, pkt->msg, pkt->length);
+
+		/* send again if it doesn't echo back in time, backing off */
+		rto = txq.rto << (pkt->retries < TXQ_RETRIES_MAX ? pkt->retries : TXQ_RETRIES_MAX);
+		if (rto > TXQ_RTO_MAX)
+		{
+			rto = TXQ_RTO_MAX;
+		}
+		left = pkt->retries < txq.max_retries ? txq.max_retries - pkt->retries : 0;
+		spread = pkt->expires > now ? (pkt->expires - now) / (left + 1) : 0;
+		if (rto > spread)
 		{
-			ibus_log("ibus_service_queue(%d): ", pkt->length);
-			ibus_dump_hex(flog, pkt->msg, pkt->length, FALSE);
-			write(ifd, pkt->msg, pkt->length);
-			//tcdrain(ifd);
-			/* send again if it doesn't echo back within 1.4 seconds */
-			pkt->countdown = 28;
+			/* the rest of the retries must fit before the deadline */
+			rto = spread > TXQ_RTO_MIN ? spread : TXQ_RTO_MIN;
+		}
+		pkt->due = now + rto;
+		pkt->sent_usec = now;
+		pkt->sent = TRUE;
+		txq.last_sent = txq.head[prio];
+		if (pkt->retries >= txq.max_retries)
+		{
+			/* the last try, give up at due */
+			ibus_queue_arm();
+		}
+
+		*length = pkt->length;
+		return pkt->msg;
+	}
+
+	return NULL;
+}
+
+/* the earliest time a queued frame wants the bus, 0 when there is none */
+
+uint64_t ibus_queue_due(void)
+{
+	uint64_t now = mainloop_get_usec();
+	uint64_t due = 0;
+	uint64_t at;
+	packet *pkt;
+	int prio;
+
+	for (prio = 0; prio < IBUS_PRIO_LEVELS; prio++)
+	{
+		if (txq.head[prio])
+		{
+			pkt = &txq.slot[txq.head[prio] - 1];
+			at = ibus_budget_ready(prio, pkt->length, now);
+			if (at < pkt->due)
+			{
+				at = pkt->due;
+			}
+			if (due == 0 || at < due)
+			{
+				due = at;
+			}
 		}
-		//list = list->next;
-		/* Only process the first item */
-		break;
 	}
+
+	return due;
 }
 
-void ibus_remove_from_queue(const unsigned char *msg, int length)
+/* the last frame written collided, send it again once the gate allows */
+
+void ibus_queue_resend(void)
 {
-	SList *list = pkt_list;
+	if (txq.last_sent)
+	{
+		txq.slot[txq.last_sent - 1].due = mainloop_get_usec();
+	}
+}
+
+bool ibus_remove_from_queue(const unsigned char *msg, int length, uint64_t usec)
+{
+	ibus_dest_stats *dest;
+	unsigned char s;
 	packet *pkt;
 
-	while (list)
+	if (length < 4)
 	{
-		pkt = list->data;
-		if (pkt->length == length)
+		return FALSE;
+	}
+
+	for (s = txq.hash[ibus_queue_hash(msg, length)]; s; s = pkt->hash_next)
+	{
+		pkt = &txq.slot[s - 1];
+		if (pkt->length == length && memcmp(pkt->msg, msg, length) == 0)
 		{
-			if (memcmp(pkt->msg, msg, length) == 0)
+			ibus_log("ibus_remove_queue(%d): success - dequeued\n", length);
+			txq.stats.echoed++;
+			dest = &txq.dest[msg[DEST]];
+			dest->echoed++;
+			if (pkt->sent && pkt->retries == 0 && usec >= pkt->sent_usec)
 			{
-				ibus_log("ibus_remove_queue(%d): success - dequeued\n", length);
-				pkt_list = slist_remove(pkt_list, pkt);
-				free (pkt);
-				return;
+				ibus_rtt_sample(usec - pkt->sent_usec);
+				dest->rtt_samples++;
+				dest->rtt_total += usec - pkt->sent_usec;
 			}
+			ibus_free_slot(s - 1);
+			return TRUE;
 		}
-		list = list->next;
 	}
+
+	return FALSE;
 }
 
-static void ibus_add_to_queue(const unsigned char *msg, int length, int countdown)
+static bool ibus_add_to_queue(const unsigned char *msg, int length, int prio)
 {
+	unsigned int h;
 	packet *pkt;
+	int victim, s;
+
+	if (!txq.initialized)
+	{
+		ibus_queue_init();
+	}
+
+	if (txq.free == 0)
+	{
+		for (victim = IBUS_PRIO_LEVELS - 1; victim >= prio; victim--)
+		{
+			if (txq.head[victim])
+			{
+				break;
+			}
+		}
+
+		if (victim < prio)
+		{
+			ibus_log("ibus_add_to_queue(%d): queue full, dropping %02x %02x %02x\n",
+				length, msg[0], msg[1], msg[2]);
+			txq.stats.overflowed++;
+			txq.dest[msg[DEST]].failed++;
+			if (txq.failed)
+			{
+				txq.failed(msg, length, IBUS_TX_OVERFLOW);
+			}
+			return FALSE;
+		}
+
+		pkt = &txq.slot[txq.head[victim] - 1];
+		ibus_log("ibus_add_to_queue(%d): queue full, dropping %02x %02x %02x\n",
+			length, pkt->msg[0], pkt->msg[1], pkt->msg[2]);
+		txq.stats.overflowed++;
+		ibus_give_up(txq.head[victim] - 1, IBUS_TX_OVERFLOW);
+	}
+
+	s = txq.free - 1;
+	pkt = &txq.slot[s];
+	txq.free = pkt->next;
 
-	pkt = malloc(sizeof(packet));
 	memcpy(pkt->msg, msg, length);
 	pkt->length = length;
-	pkt->countdown = countdown;
+	pkt->queued = mainloop_get_usec();
+	pkt->due = pkt->queued;
+	pkt->sent_usec = 0;
+	pkt->expires = pkt->queued + txq_deadline[prio];
+	pkt->retries = 0;
+	pkt->prio = prio;
+	pkt->sent = FALSE;
+	pkt->deferred = FALSE;
 
-	pkt_list = slist_append(pkt_list, pkt);
+	pkt->next = 0;
+	if (txq.tail[prio])
+	{
+		txq.slot[txq.tail[prio] - 1].next = s + 1;
+	}
+	else
+	{
+		txq.head[prio] = s + 1;
+	}
+	txq.tail[prio] = s + 1;
+
+	h = ibus_queue_hash(msg, length);
+	pkt->hash_next = txq.hash[h];
+	txq.hash[h] = s + 1;
+
+	txq.count++;
+	txq.stats.enqueued++;
+	ibus_queue_arm();
+	if (txq.count > txq.stats.high_water)
+	{
+		txq.stats.high_water = txq.count;
+	}
+
+	if (txq.wakeup)
+	{
+		txq.wakeup();
+	}
+
+	return TRUE;
+}
+
+const ibus_queue_stats *ibus_get_queue_stats(void)
+{
+	return &txq.stats;
 }
 
-void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number)
+const ibus_dest_stats *ibus_get_dest_stats(int dest)
+{
+	return &txq.dest[dest & 0xFF];
+}
+
+/* retransmits before a frame is given up, 0..TXQ_RETRIES_MAX */
+
+void ibus_set_tx_retries(int max_retries)
+{
+	if (max_retries < 0 || max_retries > TXQ_RETRIES_MAX)
+	{
+		return;
+	}
+	txq.max_retries = max_retries;
+}
+
+/* bytes/s for a class, or IBUS_BUDGET_TOTAL, 0 = unlimited */
+
+void ibus_set_tx_budget(int which, int rate)
+{
+	if (which < 0 || which > IBUS_BUDGET_TOTAL || rate < 0)
+	{
+		return;
+	}
+	txq.budget[which].rate = rate;
+	txq.budget[which].credit = 0;
+	txq.budget[which].last = 0;
+}
+
+int ibus_get_tx_budget(int which)
+{
+	return txq.budget[which].rate;
+}
+
+void ibus_set_tx_failed(ibus_tx_failed_func func)
+{
+	txq.failed = func;
+}
+
+void ibus_set_tx_wakeup(ibus_tx_wakeup_func func)
+{
+	txq.wakeup = func;
+}
+
+void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number, int prio)
 {
 	unsigned char sum;
 	int i;
 
+	if (length < 4 || length > IBUS_FRAME_MAX || prio < 0 || prio >= IBUS_PRIO_LEVELS)
+	{
+		ibus_log("ibus_send(%d): \033[31mbad length\033[m\n", length);
+		return;
+	}
+
 	ibus_log("ibus_send(%d): %02x %02x %02x queued\n", length, msg[0], msg[1], msg[2]);
 
 	sum = msg[0];
@@ -131,6 +721,6 @@ void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number)
 
 	if (gpio_number > 0)
 	{
-		ibus_add_to_queue(msg, length, 1);
+		ibus_add_to_queue(msg, length, prio);
 	}
 }
@@ -1,5 +1,58 @@
+/* priority classes for ibus_send(), most urgent first */
+#define IBUS_PRIO_URGENT 0	/* replies the radio is waiting for */
+#define IBUS_PRIO_NORMAL 1
+#define IBUS_PRIO_LOW 2		/* announcements and requests that repeat anyway */
+#define IBUS_PRIO_LEVELS 3
+#define IBUS_BUDGET_TOTAL IBUS_PRIO_LEVELS	/* ibus_set_tx_budget() for all classes */
 
-void ibus_service_queue(int ifd, bool can_send, int gpio_number);
-void ibus_remove_from_queue(const unsigned char *msg, int length);
-void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number);
+/* why a frame was given up, passed to the failure callback */
+#define IBUS_TX_RETRIES 0	/* no echo after the maximum retransmits */
+#define IBUS_TX_EXPIRED 1	/* still queued past its class deadline */
+#define IBUS_TX_OVERFLOW 2	/* dropped, queue full */
 
+typedef void (*ibus_tx_failed_func) (const unsigned char *msg, int length, int reason);
+typedef void (*ibus_tx_wakeup_func) (void);
+
+typedef struct
+{
+	unsigned int enqueued;
+	unsigned int echoed;
+	unsigned int retransmitted;
+	unsigned int expired;		/* no echo within the queue lifetime */
+	unsigned int overflowed;	/* oldest frame dropped, queue full */
+	unsigned int failed;		/* no echo after the maximum retransmits */
+	int high_water;
+	uint64_t srtt;		/* usec, write to echo */
+	uint64_t rttvar;
+	uint64_t rto;
+	unsigned int first_sends;
+	uint64_t wait_total;	/* usec from ibus_send() to first write */
+	uint64_t wait_max;
+	unsigned long bytes[IBUS_PRIO_LEVELS];		/* written, retransmits included */
+	unsigned int deferred[IBUS_PRIO_LEVELS];	/* frames held back by the budget */
+}
+ibus_queue_stats;
+
+typedef struct
+{
+	unsigned int sent;		/* writes, retransmits included */
+	unsigned int retransmitted;
+	unsigned int echoed;
+	unsigned int failed;		/* given up for any reason */
+	unsigned int rtt_samples;
+	uint64_t rtt_total;		/* usec */
+}
+ibus_dest_stats;
+
+const unsigned char *ibus_queue_take(uint64_t now, int *length);
+uint64_t ibus_queue_due(void);
+void ibus_queue_resend(void);
+bool ibus_remove_from_queue(const unsigned char *msg, int length, uint64_t usec);
+void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number, int prio);
+const ibus_queue_stats *ibus_get_queue_stats(void);
+const ibus_dest_stats *ibus_get_dest_stats(int dest);
+void ibus_set_tx_retries(int max_retries);
+void ibus_set_tx_budget(int which, int rate);
+int ibus_get_tx_budget(int which);
+void ibus_set_tx_failed(ibus_tx_failed_func func);
+void ibus_set_tx_wakeup(ibus_tx_wakeup_func func);
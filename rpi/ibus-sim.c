@@ -0,0 +1,941 @@
+/*
+ * ibus-sim - pretend to be the car for pibus-host, over a pseudo terminal
+ *
+ * Starts pibus-host on the slave side of a pty and plays radio, IKE, MFL
+ * and BMBT on the master side, echoing everything pibus writes the way
+ * the bus transceiver does. Measures end to end latencies:
+ *
+ *   key    BMBT button frame -> key event (evdev node, or the stub keyboard)
+ *   cdc    radio CDC poll -> our poll response on the wire
+ *   gpio   IKE reverse gear frame -> camera relay on the stub gpio backend
+ *   tx     MFL next track -> our start_playing status on the wire
+ *   knob   BMBT knob turned KNOB_DETENTS steps -> the last of its key events,
+ *          or the wheel event with pibus -w
+ *
+ * and prints mean/p50/p99/max for each, once per background load given
+ * with -b, along with the write() calls pibus's main thread made per
+ * knob detent (from /proc, so that needs ptrace access to the child).
+ * Bytes go out on the pty at the bus's 9600 baud pace, so the background
+ * load keeps the bus busy the way real traffic would.
+ *
+ * With -q the bus then goes quiet for that many seconds and the times
+ * pibus's main thread was woken up are counted, again from /proc; the
+ * exit status is 1 if that is more than QUIET_WAKEUPS a second.
+ *
+ * Without /dev/uinput pibus-host can't create its keyboard; build
+ * pibus-host-stubkb and run with -p ./pibus-host-stubkb, the keys then
+ * come in through the stub pipe like the gpio changes.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+
+#define TRUE 1
+#define FALSE 0
+
+typedef int bool;
+
+#define GPIO_RELAY_CTL 27	/* camera relay, see ibus.c */
+#define KEY_CODE_1 1		/* "1" on the BMBT is KEY_ESC */
+#define TIMEOUT_USEC 1000000
+#define BYTE_USEC 1146		/* 11 bits at 9600 baud */
+#define MAX_LOADS 16
+#define KNOB_DETENTS 4
+#define QUIET_WAKEUPS 5		/* per second, the hw v4 LED heartbeat alone is 2 */
+
+typedef enum
+{
+	M_KEY = 0,
+	M_CDC,
+	M_GPIO,
+	M_TX,
+	M_KNOB,
+	M_LAST
+}
+measure_t;
+
+static const char *measure_name[M_LAST] = { "key", "cdc", "gpio", "tx", "knob" };
+
+static const unsigned char cdc_screen[] = { 0x68, 0x12, 0x3b, 0x23, 0x62, 0x10, 0x43, 0x44, 0x43, 0x20, 0x31, 0x2d, 0x30, 0x34, 0x20, 0x20, 0x20, 0x20, 0x20, 0x4c };
+static const unsigned char bmbt_1[] = { 0xF0, 0x04, 0x68, 0x48, 0x11, 0xC5 };
+static const unsigned char cdc_poll[] = { 0x68, 0x03, 0x18, 0x01, 0x72 };
+static const unsigned char cdc_reply[] = { 0x18, 0x04, 0xFF, 0x02, 0x00, 0xE1 };
+static const unsigned char mfl_next[] = { 0x50, 0x04, 0x68, 0x3B, 0x01, 0x06 };
+static const unsigned char bmbt_knob[] = { 0xF0, 0x04, 0x3B, 0x49, 0x80 | KNOB_DETENTS, 0x00 };
+static const unsigned char start_playing[] = { 0x18, 0x0A, 0x68, 0x39, 0x02, 0x09, 0x00, 0x01, 0x00, 0x01, 0x04, 0x4C };
+
+static struct
+{
+	int master;
+	int stub;		/* actions reported by the pibus-host stubs */
+	int evdev;
+	pid_t child;
+
+	unsigned char tx[512];	/* what pibus wrote, being cut into frames */
+	int tx_len;
+	uint64_t tx_first;	/* first byte of the frame in tx */
+	uint64_t tx_last;
+	int collide;		/* percent of pibus frames that collide */
+	bool lost;		/* rest of a collided frame, not on the bus */
+	long collisions;
+	long wasted;		/* pibus bytes in collided frames */
+	char line[512];		/* partial stub line */
+	int line_len;
+
+	unsigned char wire[8192];	/* bytes waiting for their turn on the bus */
+	int wire_len;
+	uint64_t wire_bytes;	/* written so far */
+	uint64_t next_byte;	/* usec */
+
+	bool reverse;
+	uint64_t mark[M_LAST];	/* stimulus is on the wire once wire_bytes gets here */
+	uint64_t sent[M_LAST];	/* 0 = nothing outstanding */
+	uint64_t *lat[M_LAST];
+	int count[M_LAST];
+	int missed[M_LAST];
+	bool stall;		/* don't echo anything but the poll reply */
+	long echoed;
+	long stalled;
+	long background;
+	int knob_keys;		/* key events of the outstanding knob turn */
+	uint64_t knob_syscw;	/* pibus write() calls when it was sent */
+	uint64_t knob_writes;	/* during finished knob turns */
+}
+sim;
+
+
+static uint64_t now_usec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void bus_write(const unsigned char *msg, int length)
+{
+	if (sim.wire_len + length > sizeof(sim.wire))
+	{
+		return;
+	}
+
+	memcpy(sim.wire + sim.wire_len, msg, length);
+	sim.wire_len += length;
+}
+
+/* put whatever is due on the pty, one byte per byte time */
+
+static void wire_pump(uint64_t t)
+{
+	int m;
+
+	while (sim.wire_len > 0 && t >= sim.next_byte)
+	{
+		if (write(sim.master, sim.wire, 1) != 1)
+		{
+			return;
+		}
+		memmove(sim.wire, sim.wire + 1, --sim.wire_len);
+		sim.wire_bytes++;
+
+		if (sim.next_byte + BYTE_USEC < t)
+		{
+			sim.next_byte = t;
+		}
+		sim.next_byte += BYTE_USEC;
+
+		for (m = 0; m < M_LAST; m++)
+		{
+			if (sim.mark[m] && sim.wire_bytes >= sim.mark[m])
+			{
+				sim.mark[m] = 0;
+				sim.sent[m] = t;
+			}
+		}
+	}
+}
+
+/* a counter of pibus's main thread from /proc, e.g. "io", "syscw: %llu" */
+
+static uint64_t child_counter(const char *file, const char *format)
+{
+	unsigned long long n = 0;
+	char path[64], line[64];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/%s", (int) sim.child, (int) sim.child, file);
+	f = fopen(path, "r");
+	if (!f)
+	{
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, format, &n) == 1)
+		{
+			break;
+		}
+	}
+	fclose(f);
+
+	return n;
+}
+
+/* write() calls made by pibus's main thread so far */
+
+static uint64_t child_syscw(void)
+{
+	return child_counter("io", "syscw: %llu");
+}
+
+/* times pibus's main thread went to sleep, each one ends in a wakeup */
+
+static uint64_t child_wakeups(void)
+{
+	return child_counter("status", "voluntary_ctxt_switches: %llu");
+}
+
+static void make_frame(unsigned char *msg, int length)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < length - 1; i++)
+	{
+		sum ^= msg[i];
+	}
+	msg[length - 1] = sum;
+}
+
+static void measured(measure_t m, uint64_t t)
+{
+	if (sim.sent[m] == 0)
+	{
+		return;
+	}
+
+	sim.lat[m][sim.count[m]++] = t - sim.sent[m];
+	sim.sent[m] = 0;
+}
+
+static void send_stimulus(measure_t m)
+{
+	unsigned char ike[12] = { 0x80, 0x0A, 0xBF, 0x13, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	unsigned char knob[sizeof(bmbt_knob)];
+
+	switch (m)
+	{
+		case M_KEY:
+			bus_write(bmbt_1, sizeof(bmbt_1));
+			break;
+
+		case M_CDC:
+			bus_write(cdc_poll, sizeof(cdc_poll));
+			break;
+
+		case M_GPIO:
+			/* toggle reverse gear, the relay follows */
+			sim.reverse = !sim.reverse;
+			ike[5] = sim.reverse ? 0x10 : 0x00;
+			make_frame(ike, sizeof(ike));
+			bus_write(ike, sizeof(ike));
+			break;
+
+		case M_TX:
+			bus_write(mfl_next, sizeof(mfl_next));
+			break;
+
+		case M_KNOB:
+			memcpy(knob, bmbt_knob, sizeof(knob));
+			make_frame(knob, sizeof(knob));
+			bus_write(knob, sizeof(knob));
+			sim.knob_keys = 0;
+			sim.knob_syscw = child_syscw();
+			break;
+
+		default:
+			break;
+	}
+
+	/* latency counts from the last byte of the stimulus */
+	sim.mark[m] = sim.wire_bytes + sim.wire_len;
+}
+
+static void send_background(void)
+{
+	static unsigned char speed = 0;
+	unsigned char ike[7] = { 0x80, 0x05, 0xBF, 0x18, 0x00, 0x00, 0x00 };
+
+	/* IKE speed/rpm */
+	ike[4] = speed++;
+	ike[5] = 0x20;
+	make_frame(ike, sizeof(ike));
+	bus_write(ike, sizeof(ike));
+	sim.background++;
+}
+
+/*
+	bytes written by pibus: echo them like the transceiver, byte by byte
+	at the bus pace, and look for replies. With stall set only the
+	measured reply is echoed, everything else stays in pibus's queue and
+	keeps being retried - a TX backlog. With collide set, that share of
+	pibus's frames meets another module starting at the same moment: the
+	other frame wins and what pibus keeps writing is lost.
+*/
+
+static void tx_frames(uint64_t t)
+{
+	int len;
+	bool reply;
+
+	while (sim.tx_len >= 2 && sim.tx_len >= sim.tx[1] + 2)
+	{
+		len = sim.tx[1] + 2;
+		reply = len == sizeof(cdc_reply) && memcmp(sim.tx, cdc_reply, len) == 0;
+		if (reply)
+		{
+			measured(M_CDC, t);
+		}
+		if (len == sizeof(start_playing) && memcmp(sim.tx, start_playing, len) == 0)
+		{
+			/* from when it started going out */
+			measured(M_TX, sim.tx_first);
+		}
+		if (sim.stall)
+		{
+			if (reply)
+			{
+				bus_write(sim.tx, len);
+				sim.echoed += len;
+			}
+			else
+			{
+				sim.stalled++;
+			}
+		}
+		memmove(sim.tx, sim.tx + len, sim.tx_len - len);
+		sim.tx_len -= len;
+		sim.tx_first = t;
+	}
+}
+
+static void handle_tx(uint64_t t)
+{
+	unsigned char buf[256], other[7] = { 0x80, 0x05, 0xBF, 0x18, 0x00, 0x20, 0x00 };
+	int r, i;
+
+	r = read(sim.master, buf, sizeof(buf));
+	if (r <= 0)
+	{
+		return;
+	}
+
+	if ((sim.lost || sim.tx_len > 0) && t - sim.tx_last > 5 * BYTE_USEC)
+	{
+		/* pibus gave up on that frame */
+		sim.lost = FALSE;
+		sim.tx_len = 0;
+	}
+	sim.tx_last = t;
+
+	for (i = 0; i < r; i++)
+	{
+		if (sim.lost)
+		{
+			sim.wasted++;
+			continue;
+		}
+
+		if (sim.tx_len == 0)
+		{
+			sim.tx_first = t;
+			if (!sim.stall && (sim.wire_len > 0 || t < sim.next_byte))
+			{
+				/* started while the bus was busy */
+				sim.collisions++;
+				sim.wasted++;
+				sim.lost = TRUE;
+				continue;
+			}
+			if (!sim.stall && rand() % 100 < sim.collide)
+			{
+				make_frame(other, sizeof(other));
+				bus_write(other, sizeof(other));
+				sim.collisions++;
+				sim.wasted++;
+				sim.lost = TRUE;
+				continue;
+			}
+		}
+
+		if (!sim.stall)
+		{
+			bus_write(buf + i, 1);
+			sim.echoed++;
+		}
+
+		if (sim.tx_len == sizeof(sim.tx))
+		{
+			sim.tx_len = 0;
+		}
+		sim.tx[sim.tx_len++] = buf[i];
+		tx_frames(t);
+	}
+}
+
+/* a key event of the knob turn, the last one ends the measurement */
+
+static void knob_key(uint64_t t)
+{
+	if (sim.sent[M_KNOB] == 0 || ++sim.knob_keys < KNOB_DETENTS)
+	{
+		return;
+	}
+
+	sim.knob_writes += child_syscw() - sim.knob_syscw;
+	measured(M_KNOB, t);
+}
+
+static void handle_stub_line(const char *line, uint64_t t)
+{
+	int gpio, value, key, n;
+
+	if (sscanf(line, "gpio %d=%d", &gpio, &value) == 2)
+	{
+		if (gpio == GPIO_RELAY_CTL && value == sim.reverse)
+		{
+			measured(M_GPIO, t);
+		}
+	}
+	else if (sscanf(line, "wheel %d %d", &key, &n) == 2 && n > 0)
+	{
+		/* pibus -w: the whole turn in one event */
+		sim.knob_keys += n - 1;
+		knob_key(t);
+	}
+	else if (strncmp(line, "key", 3) == 0)
+	{
+		/* "key a b c", one line per batch */
+		for (line += 3; sscanf(line, " %d%n", &key, &n) == 1; line += n)
+		{
+			if (key == KEY_CODE_1)
+			{
+				measured(M_KEY, t);
+			}
+			else if (key == KEY_UP)
+			{
+				knob_key(t);
+			}
+		}
+	}
+}
+
+static void handle_stub(uint64_t t)
+{
+	int r, i;
+
+	r = read(sim.stub, sim.line + sim.line_len, sizeof(sim.line) - sim.line_len - 1);
+	if (r <= 0)
+	{
+		return;
+	}
+	sim.line_len += r;
+
+	for (i = 0; i < sim.line_len; i++)
+	{
+		if (sim.line[i] == '\n')
+		{
+			sim.line[i] = 0;
+			handle_stub_line(sim.line, t);
+			memmove(sim.line, sim.line + i + 1, sim.line_len - i - 1);
+			sim.line_len -= i + 1;
+			i = -1;
+		}
+	}
+
+	if (sim.line_len == sizeof(sim.line) - 1)
+	{
+		sim.line_len = 0;
+	}
+}
+
+static void handle_evdev(uint64_t t)
+{
+	struct input_event ev[16];
+	int r, i;
+
+	r = read(sim.evdev, ev, sizeof(ev));
+	for (i = 0; i < r / (int) sizeof(ev[0]); i++)
+	{
+		if (ev[i].type == EV_KEY && ev[i].code == KEY_CODE_1 && ev[i].value == 1)
+		{
+			measured(M_KEY, t);
+		}
+		if (ev[i].type == EV_KEY && ev[i].code == KEY_UP && ev[i].value == 1)
+		{
+			knob_key(t);
+		}
+	}
+}
+
+/* the uinput device pibus-host created, if we can read it */
+
+static int open_evdev(void)
+{
+	char path[300], name[64];
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	dir = opendir("/dev/input");
+	if (!dir)
+	{
+		return -1;
+	}
+
+	while ((de = readdir(dir)))
+	{
+		if (strncmp(de->d_name, "event", 5) != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0)
+			continue;
+
+		if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) > 0 && strcmp(name, "uinput-ibus") == 0)
+		{
+			closedir(dir);
+			return fd;
+		}
+		close(fd);
+	}
+
+	closedir(dir);
+	return -1;
+}
+
+static pid_t start_pibus(const char *pibus, char **args, int nargs, const char *slave, int stub_fd)
+{
+	char *argv[64];
+	char env[32];
+	pid_t pid;
+	int i, n = 0;
+
+	argv[n++] = (char *) pibus;
+	for (i = 0; i < nargs && n < 62; i++)
+	{
+		argv[n++] = args[i];
+	}
+	argv[n++] = (char *) slave;
+	argv[n] = NULL;
+
+	pid = fork();
+	if (pid == 0)
+	{
+		snprintf(env, sizeof(env), "%d", stub_fd);
+		setenv("PIBUS_STUB_FD", env, 1);
+		execv(pibus, argv);
+		perror(pibus);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(double load)
+{
+	uint64_t sum;
+	int m, n, i;
+
+	printf("background load %.0f frames/s\n", load);
+	printf("%-6s %8s %8s %10s %10s %10s %10s\n", "", "samples", "missed", "mean us", "p50 us", "p99 us", "max us");
+	for (m = 0; m < M_LAST; m++)
+	{
+		n = sim.count[m];
+		if (n == 0)
+		{
+			printf("%-6s %8d %8d %10s %10s %10s %10s\n", measure_name[m], 0, sim.missed[m], "-", "-", "-", "-");
+			continue;
+		}
+
+		for (i = 0, sum = 0; i < n; i++)
+		{
+			sum += sim.lat[m][i];
+		}
+
+		qsort(sim.lat[m], n, sizeof(uint64_t), cmp_u64);
+		printf("%-6s %8d %8d %10llu %10llu %10llu %10llu\n", measure_name[m], n, sim.missed[m],
+			(unsigned long long) (sum / n),
+			(unsigned long long) sim.lat[m][n / 2],
+			(unsigned long long) sim.lat[m][n * 99 / 100],
+			(unsigned long long) sim.lat[m][n - 1]);
+	}
+	printf("background frames %ld, bytes echoed %ld, frames stalled %ld\n", sim.background, sim.echoed, sim.stalled);
+	if (sim.count[M_KNOB])
+	{
+		printf("knob: %.1f write() calls per detent\n",
+			(double) sim.knob_writes / (sim.count[M_KNOB] * KNOB_DETENTS));
+	}
+	if (sim.collisions)
+	{
+		printf("collisions %ld, %.1f pibus bytes on the bus per collision\n",
+			sim.collisions, (double) sim.wasted / sim.collisions);
+	}
+	printf("\n");
+}
+
+/* one measurement run at a background load, false if pibus went away */
+
+static bool run(double load, double rate, int samples)
+{
+	uint64_t next_stim, next_bg, t, deadline;
+	struct pollfd pfd[3];
+	struct timespec ts;
+	measure_t m = M_KEY;
+	int i, nfds;
+	bool done, busy;
+
+	memset(sim.count, 0, sizeof(sim.count));
+	memset(sim.missed, 0, sizeof(sim.missed));
+	memset(sim.sent, 0, sizeof(sim.sent));
+	memset(sim.mark, 0, sizeof(sim.mark));
+	sim.background = sim.echoed = sim.stalled = 0;
+	sim.collisions = sim.wasted = 0;
+	sim.knob_writes = 0;
+
+	t = now_usec();
+	next_stim = t + 200000;
+	next_bg = t;
+
+	for (;;)
+	{
+		if (waitpid(sim.child, NULL, WNOHANG) == sim.child)
+		{
+			fprintf(stderr, "pibus exited\n");
+			sim.child = 0;
+			return FALSE;
+		}
+
+		done = TRUE;
+		for (i = 0; i < M_LAST; i++)
+		{
+			if (sim.count[i] + sim.missed[i] < samples)
+			{
+				done = FALSE;
+			}
+		}
+		if (done)
+		{
+			return TRUE;
+		}
+
+		t = now_usec();
+
+		for (i = 0; i < M_LAST; i++)
+		{
+			if (sim.sent[i] && t - sim.sent[i] > TIMEOUT_USEC)
+			{
+				sim.sent[i] = 0;
+				sim.missed[i]++;
+			}
+		}
+
+		/* pibus went quiet: a collided or aborted frame is over */
+		if ((sim.lost || sim.tx_len > 0) && t - sim.tx_last > 5 * BYTE_USEC)
+		{
+			sim.lost = FALSE;
+			sim.tx_len = 0;
+		}
+
+		/* the other modules wait for pibus to finish a frame */
+		busy = sim.tx_len > 0 || sim.lost;
+
+		if (t >= next_stim && !busy)
+		{
+			/* one measurement outstanding at a time per kind */
+			if (sim.sent[m] == 0 && sim.mark[m] == 0 && sim.count[m] + sim.missed[m] < samples)
+			{
+				send_stimulus(m);
+			}
+			m = (m + 1) % M_LAST;
+			next_stim += 1000000 / rate;
+		}
+
+		if (load > 0 && t >= next_bg && !busy)
+		{
+			send_background();
+			next_bg += 1000000 / load;
+		}
+
+		wire_pump(t);
+
+		deadline = next_stim;
+		if (load > 0 && next_bg < deadline)
+		{
+			deadline = next_bg;
+		}
+		if (busy && deadline < t + BYTE_USEC)
+		{
+			deadline = t + BYTE_USEC;
+		}
+		if (sim.wire_len > 0 && sim.next_byte < deadline)
+		{
+			deadline = sim.next_byte;
+		}
+
+		nfds = 0;
+		pfd[nfds].fd = sim.master;
+		pfd[nfds++].events = POLLIN;
+		pfd[nfds].fd = sim.stub;
+		pfd[nfds++].events = POLLIN;
+		if (sim.evdev >= 0)
+		{
+			pfd[nfds].fd = sim.evdev;
+			pfd[nfds++].events = POLLIN;
+		}
+
+		t = now_usec();
+		t = deadline > t ? deadline - t : 0;
+		ts.tv_sec = t / 1000000;
+		ts.tv_nsec = (t % 1000000) * 1000;
+		ppoll(pfd, nfds, &ts, NULL);
+		t = now_usec();
+
+		if (pfd[0].revents & POLLIN)
+			handle_tx(t);
+		if (pfd[1].revents & POLLIN)
+			handle_stub(t);
+		if (nfds > 2 && (pfd[2].revents & POLLIN))
+			handle_evdev(t);
+	}
+}
+
+/* nothing on the bus but pibus's own frames until end, false if pibus went away */
+
+static bool idle(uint64_t end)
+{
+	uint64_t t, deadline;
+	struct pollfd pfd[3];
+	struct timespec ts;
+	int nfds;
+
+	while ((t = now_usec()) < end)
+	{
+		if (waitpid(sim.child, NULL, WNOHANG) == sim.child)
+		{
+			fprintf(stderr, "pibus exited\n");
+			sim.child = 0;
+			return FALSE;
+		}
+
+		wire_pump(t);
+
+		deadline = end;
+		if (sim.wire_len > 0 && sim.next_byte < deadline)
+		{
+			deadline = sim.next_byte;
+		}
+
+		nfds = 0;
+		pfd[nfds].fd = sim.master;
+		pfd[nfds++].events = POLLIN;
+		pfd[nfds].fd = sim.stub;
+		pfd[nfds++].events = POLLIN;
+		if (sim.evdev >= 0)
+		{
+			pfd[nfds].fd = sim.evdev;
+			pfd[nfds++].events = POLLIN;
+		}
+
+		t = deadline > t ? deadline - t : 0;
+		ts.tv_sec = t / 1000000;
+		ts.tv_nsec = (t % 1000000) * 1000;
+		ppoll(pfd, nfds, &ts, NULL);
+		t = now_usec();
+
+		if (pfd[0].revents & POLLIN)
+			handle_tx(t);
+		if (pfd[1].revents & POLLIN)
+			handle_stub(t);
+		if (nfds > 2 && (pfd[2].revents & POLLIN))
+			handle_evdev(t);
+	}
+
+	return TRUE;
+}
+
+/* a quiet bus for seconds, false if pibus woke up too often or went away */
+
+static bool quiet(int seconds)
+{
+	uint64_t start, wakeups;
+	double rate;
+
+	/* let whatever the last run left in the queue finish first */
+	if (!idle(now_usec() + 1000000))
+	{
+		return FALSE;
+	}
+
+	start = child_wakeups();
+	if (!idle(now_usec() + (uint64_t) seconds * 1000000))
+	{
+		return FALSE;
+	}
+	wakeups = child_wakeups() - start;
+	rate = (double) wakeups / seconds;
+
+	printf("quiet bus: %llu wakeups in %d s, %.2f/s (max %d) %s\n", (unsigned long long) wakeups,
+		seconds, rate, QUIET_WAKEUPS, rate <= QUIET_WAKEUPS ? "ok" : "FAILED");
+
+	return rate <= QUIET_WAKEUPS;
+}
+
+int main(int argc, char **argv)
+{
+	const char *pibus = "./pibus-host";
+	struct termios tio;
+	int samples = 200;
+	double rate = 10;	/* stimuli per second */
+	double load[MAX_LOADS] = { 50 };	/* background frames per second */
+	int loads = 1;
+	int quiet_seconds = 0;
+	bool ok = TRUE;
+	int stub_pipe[2];
+	int opt, i;
+	char *slave, *tok;
+
+	while ((opt = getopt(argc, argv, "b:c:n:p:q:r:sh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b':
+				loads = 0;
+				for (tok = strtok(optarg, ","); tok && loads < MAX_LOADS; tok = strtok(NULL, ","))
+				{
+					load[loads++] = atof(tok);
+				}
+				break;
+			case 'c':
+				sim.collide = atoi(optarg);
+				break;
+			case 'n':
+				samples = atoi(optarg);
+				break;
+			case 'p':
+				pibus = optarg;
+				break;
+			case 'q':
+				quiet_seconds = atoi(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 's':
+				sim.stall = TRUE;
+				break;
+			case 'h':
+			default:
+				fprintf(stderr,
+					"Usage: %s [flags] [-- pibus flags]\n"
+					"\n"
+					"Flags:\n"
+					"\t-b <rates>   Background bus frames per second, a comma separated\n"
+					"\t             list measures each in turn (default 50)\n"
+					"\t-c <percent> Collide with that share of pibus's frames\n"
+					"\t-n <count>   Samples per measurement (default 200)\n"
+					"\t-p <path>    pibus binary to test (default ./pibus-host)\n"
+					"\t-q <seconds> Then keep the bus quiet that long and fail if pibus\n"
+					"\t             wakes up more than %d times a second\n"
+					"\t-r <rate>    Measured stimuli per second (default 10)\n"
+					"\t-s           Stall: only echo the poll reply, so the rest of\n"
+					"\t             pibus's frames back up in its queue\n"
+					"\n",
+					argv[0], QUIET_WAKEUPS);
+				return -1;
+		}
+	}
+
+	for (i = 0; i < M_LAST; i++)
+	{
+		sim.lat[i] = calloc(samples, sizeof(uint64_t));
+	}
+
+	sim.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim.master < 0 || grantpt(sim.master) < 0 || unlockpt(sim.master) < 0)
+	{
+		perror("pty");
+		return -1;
+	}
+	slave = ptsname(sim.master);
+
+	tcgetattr(sim.master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(sim.master, TCSANOW, &tio);
+	fcntl(sim.master, F_SETFL, O_NONBLOCK);
+
+	if (pipe(stub_pipe) < 0)
+	{
+		perror("pipe");
+		return -1;
+	}
+	sim.stub = stub_pipe[0];
+	fcntl(sim.stub, F_SETFL, O_NONBLOCK);
+
+	signal(SIGPIPE, SIG_IGN);
+	sim.child = start_pibus(pibus, argv + optind, argc - optind, slave, stub_pipe[1]);
+	close(stub_pipe[1]);
+
+	/* give it time to come up, then switch the radio to the CD changer */
+	usleep(500000);
+	sim.evdev = open_evdev();
+	bus_write(cdc_screen, sizeof(cdc_screen));
+
+	printf("pibus on %s, keys from %s\n\n", slave, sim.evdev >= 0 ? "evdev" : "stub keyboard");
+
+	for (i = 0; i < loads; i++)
+	{
+		if (!run(load[i], rate, samples))
+		{
+			ok = FALSE;
+			break;
+		}
+		report(load[i]);
+	}
+
+	if (ok && quiet_seconds > 0)
+	{
+		ok = quiet(quiet_seconds);
+	}
+
+	if (sim.child)
+	{
+		kill(sim.child, SIGTERM);
+		waitpid(sim.child, NULL, 0);
+	}
+
+	return ok ? 0 : 1;
+}
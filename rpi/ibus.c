@@ -12,11 +12,19 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/ioctl.h>
 
 #include "keyboard.h"
 #include "gpio.h"
 #include "mainloop.h"
 #include "ibus-send.h"
+#include "ibus-rx.h"
+#include "ibus-framer.h"
+#include "ibus-dispatch.h"
+#include "logwriter.h"
+#include "capture.h"
+#include "worker.h"
+#include "timesync.h"
 #include "ibus.h"
 
 #define SOURCE 0
@@ -31,6 +39,21 @@
 #define GPIO_LED_CTL		24
 #define GPIO_RELAY_CTL		27
 
+/* 9600 baud, 8E1 */
+#define BIT_USEC		104
+#define BYTE_USEC		(11 * BIT_USEC)
+
+#define TX_IDLE_BITS		20	/* quiet bus before we transmit */
+#define TX_IDLE_BITS_MIN	11	/* a byte time, less would cut into someone's frame */
+#define TX_IDLE_BITS_MAX	1000
+#define TX_BACKOFF_MAX		5	/* up to 2^5 byte times after collisions */
+#define TX_WINDOW		2	/* bytes written ahead of their echo */
+#define TX_ECHO_TIMEOUT		20000	/* usec without an echo byte ends a transfer */
+
+#define ROTARY_SPIN_USEC	300000	/* knob messages closer than this are one spin */
+#define ROTARY_ACCEL_MAX	8	/* times the detents, at most */
+#define ROTARY_GAIN_MAX		1000	/* percent per 10 detents/s */
+
 
 typedef enum
 {
@@ -43,72 +66,137 @@ videoSource_t;
 
 static struct
 {
-	bool have_time;
-	bool have_date;
 	bool playing;
-	bool send_window_open;
 	bool keyboard_blocked;
 	bool cd_polled;
 	bool bluetooth;
 	bool have_camera;
 	bool mk3_announce;
+	bool powering_off;
 
-	uint64_t last_byte;
-	int bufPos;
-	unsigned char buf[64];
+	uint64_t last_byte;	/* microseconds */
+	uint64_t rx_usec;	/* timestamp of the message being handled */
+	ibus_framer framer;
+	ibus_dispatch dispatch;	/* index over events[] */
 	int ifd;
 	int radio_msgs;
 	int cdc_info_tag;
 	int cdc_info_interval;
 	int gpio_number;
 	int hw_version;
+	int log_mode;
+	int rotary_axis;	/* REL_WHEEL or REL_HWHEEL, 0 = arrow keys */
+	int rotary_gain;	/* percent extra per 10 detents/s */
+	int rotary_residual;	/* hundredths of a step left over */
+	int rotary_dir;		/* 1 = up, -1 = down */
+	uint64_t rotary_last;	/* usec of the last knob message */
+	int tx_tag;		/* transmit gate timer, -1 = not armed */
+	int tx_idle_bits;
+	int tx_backoff;		/* collisions in a row */
+	uint64_t tx_at;		/* when the gate timer fires */
+	uint64_t tx_not_before;	/* own frame on the wire, or backing off */
+	uint64_t tx_start;	/* our last frame is on the wire [tx_start, tx_end) */
+	uint64_t tx_end;
+	unsigned int collisions;
+
+	/* frame being written byte by byte, see ibus_tx_echo() */
+	bool tx_active;
+	unsigned char tx_frame[IBUS_FRAME_MAX];
+	int tx_len;
+	int tx_written;
+	int tx_echoed;
+	uint64_t tx_last;	/* usec of the last write or echo */
+	unsigned long tx_wasted;	/* bus bytes lost to collisions */
+
+	/* non-blocking uart output, see ibus_out_write() */
+	unsigned char out_buf[IBUS_FRAME_MAX];
+	int out_len;		/* bytes the driver hasn't taken yet */
+	int out_tag;		/* FIA_WRITE input while out_len > 0, -1 = none */
+	int out_drain_tag;	/* polls until the uart is empty, -1 = none */
+	uint64_t out_start;	/* first byte of this burst handed to the driver */
+	unsigned int out_short;	/* writes the driver took only part of */
+
+	/* per 30s stats period */
+	uint64_t stats_since;
+	unsigned long wakeups;	/* mainloop_get_wakeups() at the period start */
+	uint64_t out_busy;	/* usec the uart spent sending our bytes */
+	unsigned long bus_bytes;	/* every frame byte heard, ours included */
+	uint64_t echo_lag_total;	/* handed to the driver -> echo starts */
+	uint64_t echo_lag_max;
+	unsigned int echo_lags;
+	unsigned long budget_bytes[IBUS_PRIO_LEVELS];	/* queue stats at the period start */
+	const char *log_path;
+	const char *capture_path;
 
 	videoSource_t videoSource;
 	time_t start;
 
-	char hhmm[24];
-	char yyyymmdd[24];
 }
 ibus =
 {
-	.have_time = FALSE,
-	.have_date = FALSE,
 	.playing = FALSE,
-	.send_window_open = FALSE,
 	.keyboard_blocked = TRUE,
 	.cd_polled = FALSE,
 	.bluetooth = FALSE,
 	.have_camera = TRUE,
 	.mk3_announce = TRUE,
+	.powering_off = FALSE,
 
 	.last_byte = 0,
-	.bufPos = 0,
-	.buf = {0,},
+	.rx_usec = 0,
 	.ifd = -1,
 	.radio_msgs = 0,
 	.cdc_info_tag = -1,
 	.cdc_info_interval = 0,
 	.gpio_number = 0,
 	.hw_version = 0,
+	.log_mode = IBUS_LOG_TEXT,
+	.rotary_axis = 0,
+	.rotary_gain = 0,
+	.rotary_residual = 0,
+	.rotary_dir = 0,
+	.rotary_last = 0,
+	.tx_tag = -1,
+	.tx_idle_bits = TX_IDLE_BITS,
+	.tx_backoff = 0,
+	.tx_at = 0,
+	.tx_not_before = 0,
+	.tx_start = 0,
+	.tx_end = 0,
+	.collisions = 0,
+	.tx_active = FALSE,
+	.tx_wasted = 0,
+	.out_len = 0,
+	.out_tag = -1,
+	.out_drain_tag = -1,
+	.out_start = 0,
+	.out_short = 0,
+	.stats_since = 0,
+	.wakeups = 0,
+	.out_busy = 0,
+	.bus_bytes = 0,
+	.echo_lag_total = 0,
+	.echo_lag_max = 0,
+	.echo_lags = 0,
+#if defined(__i386__) || defined(__x86_64__)
+	.log_path = "./ibus.txt",
+	.capture_path = "./ibus.cap",
+#else
+	.log_path = "/storage/ibus.txt",
+	.capture_path = "/storage/ibus.cap",
+#endif
 
 	.videoSource = VIDEO_SRC_BMW,
 	.start = 0,
-
-	.hhmm = {0,},
-	.yyyymmdd = {0,},
 };
 
-FILE *flog;
-
 void ibus_log(char *fmt, ...)
 {
-	static char buf[512];
+	char buf[512];
 	va_list args;
-	struct timespec ts;
 	int len;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	sprintf(buf, "%6.6lu ", ts.tv_sec - ibus.start);
+	sprintf(buf, "%6.6lu ", (unsigned long) (mainloop_get_usec() / 1000000 - ibus.start));
 	len = 7;
 
 	va_start(args, fmt);
@@ -119,22 +207,31 @@ void ibus_log(char *fmt, ...)
 	if (len < 0 || len > (sizeof(buf) - 1))
 		len = strlen (buf);
 
-	fwrite(buf, len, 1, flog);
+	logwriter_write(buf, len);
+}
+
+bool ibus_log_text(void)
+{
+	return (ibus.log_mode & IBUS_LOG_TEXT) != 0;
 }
 
 static void power_off(void)
 {
-	fflush(flog);
-	fclose(flog);
-	flog = NULL;
+	static char *poweroff[] = { "/sbin/poweroff", NULL };
+
+	if (ibus.powering_off)
+		return;
+	ibus.powering_off = TRUE;
+
+	capture_close();
+	logwriter_close();
 
-	system("/bin/sync");
-	sleep(1);
+	/* both on the worker, in this order */
+	worker_call(sync);
 
 	if (access("/usr/sbin/poweroff", F_OK) == 0)
-		system("/usr/sbin/poweroff");
-	else
-		system("/sbin/poweroff");
+		poweroff[0] = "/usr/sbin/poweroff";
+	worker_spawn(poweroff, WORKER_TIMEOUT);
 }
 
 static void ibus_set_video(videoSource_t src)
@@ -187,6 +284,49 @@ static void ibus_handle_ike_sensor(const unsigned char *msg, int length)
 	}
 }
 
+/* 80 06 BF 19 <outside> <coolant> 00 <sum>, degrees C */
+static void ibus_handle_coolant_temp(const unsigned char *msg, int length)
+{
+	if (length >= 7)
+	{
+		ibus_log("temperature: outside %d C, coolant %d C\n", (signed char) msg[4], msg[5]);
+	}
+}
+
+/* 80 <len> FF 24 <layout> 00 <text> <sum>, what the IKE puts on the display */
+static void ibus_log_ike_text(const char *what, const unsigned char *msg, int length)
+{
+	if (length > 7)
+	{
+		ibus_log("%s: \"%.*s\"\n", what, length - 7, (const char *) msg + 6);
+	}
+}
+
+static void ibus_handle_fc(const unsigned char *msg, int length)
+{
+	ibus_log_ike_text("fuel consumption", msg, length);
+}
+
+static void ibus_handle_outside_temp(const unsigned char *msg, int length)
+{
+	ibus_log_ike_text("outside temperature", msg, length);
+}
+
+/* 7F <len> 3F A0 <data> <sum>, the navigation computer answering diagnostics */
+static void ibus_handle_battery_voltage(const unsigned char *msg, int length)
+{
+	if (length > 5)
+	{
+		ibus_log("battery voltage: %d bytes of diagnostic data\n", length - 5);
+	}
+}
+
+/* 7F 03 3F A1 E2, busy: the tester asks again, nothing for us to send */
+static void ibus_request_battery_voltage2(const unsigned char *msg, int length)
+{
+	ibus_log("battery voltage: navigation computer busy\n");
+}
+
 static bool ibus_good_checksum(const unsigned char *msg, int length)
 {
 	unsigned char sum;
@@ -206,23 +346,30 @@ static bool ibus_good_checksum(const unsigned char *msg, int length)
 	return TRUE;
 }
 
-void ibus_dump_hex(FILE *out, const unsigned char *data, int length, bool check_the_sum)
+void ibus_dump_hex(const unsigned char *data, int length, bool check_the_sum)
 {
-	int i;
+	static const char hex[] = "0123456789abcdef";
+	char buf[LOG_RECORD_MAX];
+	int i, len = 0;
 
-	for (i = 0; i < length; i++)
+	for (i = 0; i < length && len < sizeof(buf) - 16; i++)
 	{
-		fprintf(out, "%02x ", data[i]);
+		buf[len++] = hex[data[i] >> 4];
+		buf[len++] = hex[data[i] & 15];
+		buf[len++] = ' ';
 	}
 
 	if (check_the_sum && (!ibus_good_checksum(data, length)))
 	{
-		fprintf(out, "(corrupt)\n");
+		memcpy(buf + len, "(corrupt)\n", 10);
+		len += 10;
 	}
 	else
 	{
-		fprintf(out, "\n");
+		buf[len++] = '\n';
 	}
+
+	logwriter_write(buf, len);
 }
 
 static void ibus_request_time(void)
@@ -230,7 +377,7 @@ static void ibus_request_time(void)
 	/* CDChanger asks IKE for Time */
 	RODATA rt[] = "\x18\x05\x80\x41\x01\x01\xDC";
 
-	ibus_send(ibus.ifd, rt, 7, ibus.gpio_number);
+	ibus_send(ibus.ifd, rt, 7, ibus.gpio_number, IBUS_PRIO_LOW);
 }
 
 static void ibus_request_date(void)
@@ -238,30 +385,26 @@ static void ibus_request_date(void)
 	/* CDChanger asks IKE for Date */
 	RODATA rd[] = "\x18\x05\x80\x41\x02\x01\xDF";
 
-	ibus_send(ibus.ifd, rd, 7, ibus.gpio_number);
+	ibus_send(ibus.ifd, rd, 7, ibus.gpio_number, IBUS_PRIO_LOW);
 }
 
-static void ibus_set_time_and_date(void)
-{
-	char buf[64];
+/* what timesync asks of the IKE */
 
-	if (ibus.have_time && ibus.have_date)
+static void ibus_timesync_request(int what)
+{
+	if (what == TIMESYNC_TIME)
 	{
-		snprintf(buf, sizeof(buf), "date -s \"%s %s\"", ibus.yyyymmdd, ibus.hhmm);
-		system(buf);
-
-		ibus_log("setting: %s\n", buf);
+		ibus_request_time();
+	}
+	else
+	{
+		ibus_request_date();
 	}
 }
 
 static void ibus_handle_date(const unsigned char *msg, int length)
 {
-	if (length > 15 && !ibus.have_date)
-	{
-		ibus.have_date = TRUE;
-		snprintf(ibus.yyyymmdd, sizeof(ibus.yyyymmdd), "%c%c%c%c-%c%c-%c%c", msg[12], msg[13], msg[14], msg[15], msg[9], msg[10], msg[6], msg[7]);
-		ibus_set_time_and_date();
-	}
+	timesync_handle_date(msg, length, ibus.rx_usec);
 }
 
 static void ibus_handle_time(const unsigned char *msg, int length)
@@ -285,21 +428,56 @@ static void ibus_handle_time(const unsigned char *msg, int length)
 1/26/2010 5:04:11 PM.303:  80 0F E7 24 02 00 30 31 2F 32 36 2F 32 30 31 30 48
 1/26/2010 5:04:11 PM.303:  IKE  --> ANZV: Update Text:  Layout=Date  Fld0,EndTx="01/26/2010"
 */
-	int hour;
+	timesync_handle_time(msg, length, ibus.rx_usec);
+}
+
+/*
+	Knob as a wheel: one relative event per knob message, the detents
+	scaled up by how fast the knob turns. The speed comes from the time
+	since the previous message of the same spin; every 10 detents/s add
+	rotary_gain percent, up to ROTARY_ACCEL_MAX times. Fractions of a
+	step carry over to the next message until the spin ends or turns
+	around.
+*/
+
+static void ibus_rotary_wheel(int steps, uint64_t usec)
+{
+	uint64_t dt = usec - ibus.rotary_last;
+	int dir = steps > 0 ? 1 : -1;
+	uint64_t accel;
+	int factor = 100;
+	int scaled;
 
-	if (length > 12 && !ibus.have_time)
+	if (ibus.rotary_last == 0 || dt >= ROTARY_SPIN_USEC || dir != ibus.rotary_dir)
 	{
-		hour = atoi((const char *)msg + 6);
+		ibus.rotary_residual = 0;
+	}
+	else if (ibus.rotary_gain > 0 && dt > 0)
+	{
+		/* clamped before it goes into an int, knob messages can be microseconds apart */
+		accel = ibus.rotary_gain * (abs(steps) * 1000000ULL / dt) / 10;
+		factor = accel < (ROTARY_ACCEL_MAX - 1) * 100 ? 100 + accel : ROTARY_ACCEL_MAX * 100;
+	}
+	ibus.rotary_last = usec;
+	ibus.rotary_dir = dir;
 
-		if (msg[11] == 'P')
-		{
-			hour += 12;
-		}
+	scaled = steps * factor + ibus.rotary_residual;
+	ibus.rotary_residual = scaled % 100;
+
+	keyboard_wheel(ibus.rotary_axis, scaled / 100);
+}
+
+/* 0 when the gain is taken, 0..ROTARY_GAIN_MAX */
 
-		ibus.have_time = TRUE;
-		snprintf(ibus.hhmm, sizeof(ibus.hhmm), "%02d:%c%c", hour, msg[9], msg[10]);
-		ibus_set_time_and_date();
+int ibus_set_rotary_wheel(int axis, int gain)
+{
+	if (gain < 0 || gain > ROTARY_GAIN_MAX)
+	{
+		return -1;
 	}
+	ibus.rotary_axis = axis;
+	ibus.rotary_gain = gain;
+	return 0;
 }
 
 static void ibus_handle_rotary(const unsigned char *msg, int length)
@@ -311,6 +489,15 @@ static void ibus_handle_rotary(const unsigned char *msg, int length)
 		return;
 	}
 
+	if (ibus.rotary_axis)
+	{
+		if ((msg[4] & 0x0F) && !(msg[4] & 0x70))
+		{
+			ibus_rotary_wheel(msg[4] & 0x80 ? msg[4] & 0x0F : -(msg[4] & 0x0F), ibus.rx_usec);
+		}
+		return;
+	}
+
 	switch (msg[4] & 0xF0)
 	{
 		case 0x80:
@@ -325,10 +512,12 @@ static void ibus_handle_rotary(const unsigned char *msg, int length)
 			return;
 	}
 
+	/* the whole burst goes to uinput in one write */
 	for (i = 0; i < (msg[4] & 0x0F); i++)
 	{
-		keyboard_generate(key);
+		keyboard_batch_key(key);
 	}
+	keyboard_batch_flush();
 }
 
 static void ibus_handle_outsidekey(const unsigned char *msg, int length)
@@ -385,11 +574,11 @@ static void cdchanger_send_inforeq(void)
 	if (ibus.playing)
 	{
 		/* This un-mutes the line-in */
-		ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number);
+		ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 	}
 	else
 	{
-		ibus_send(ibus.ifd, not_playing, 12, ibus.gpio_number);
+		ibus_send(ibus.ifd, not_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 	}
 
 	/* No more announcements */
@@ -432,19 +621,19 @@ static void cdchanger_handle_cdcmode(const unsigned char *msg, int length)
 
 static void cdchanger_handle_stop(const unsigned char *msg, int length)
 {
-	ibus_send(ibus.ifd, not_playing, 12, ibus.gpio_number);
+	ibus_send(ibus.ifd, not_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 	ibus.playing = FALSE;
 }
 
 static void cdchanger_handle_pause(const unsigned char *msg, int length)
 {
-	ibus_send(ibus.ifd, pause_playing, 12, ibus.gpio_number);
+	ibus_send(ibus.ifd, pause_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 	ibus.playing = FALSE;
 }
 
 static void cdchanger_handle_start(const unsigned char *msg, int length)
 {
-	ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number);
+	ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 	ibus.playing = TRUE;
 }
 
@@ -455,14 +644,14 @@ static void cdchanger_handle_diskchange(const unsigned char *msg, int length)
 		return;
 	}
 
-	ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number);
+	ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number, IBUS_PRIO_URGENT);
 }
 
 static void cdchanger_handle_poll(const unsigned char *msg, int length)
 {
 	RODATA cdc_im_here[] = "\x18\x04\xFF\x02\x00\xE1";
 
-	ibus_send(ibus.ifd, cdc_im_here, 6, ibus.gpio_number);
+	ibus_send(ibus.ifd, cdc_im_here, 6, ibus.gpio_number, IBUS_PRIO_URGENT);
 	
 	ibus.cd_polled = TRUE;
 }
@@ -543,6 +732,10 @@ events[] =
 {4, "\x80\x06\xBF\x19", "coolant-temp", NULL, 0, ibus_handle_coolant_temp},
 {4, "\x80\x09\xFF\x24", "fuel-consumption", NULL, 0, ibus_handle_fc},
 {4, "\x80\x0A\xFF\x24", "outside-temp", NULL, 0, ibus_handle_outside_temp},
+{5, "\x80\x0C\xFF\x24\x01", "time", NULL, 0, ibus_handle_time},
+{5, "\x80\x0C\xE7\x24\x01", "time", NULL, 0, ibus_handle_time},
+{5, "\x80\x0F\xFF\x24\x02", "date", NULL, 0, ibus_handle_date},
+{5, "\x80\x0F\xE7\x24\x02", "date", NULL, 0, ibus_handle_date},
 {4, "\x7F\x20\x3F\xA0", "battery-voltage", NULL, 0, ibus_handle_battery_voltage},
 {5, "\x7F\x03\x3F\xA1\xE2", "re-battery-voltage", NULL, 0, ibus_request_battery_voltage2},
 
@@ -561,13 +754,380 @@ events[] =
 #endif
 };
 
+#define NUM_EVENTS (sizeof(events) / sizeof(events[0]))
 
-static void ibus_handle_message(const unsigned char *msg, int length)
+static int ibus_find_event(const unsigned char *msg, int length)
+{
+	return ibus_dispatch_find(&ibus.dispatch, msg, length);
+}
+
+/*
+	UART output. The port is non-blocking: whatever the driver doesn't
+	take right away waits in out_buf and goes out from a FIA_WRITE input,
+	so the mainloop never sleeps in write(). Once the driver has it all
+	we poll TIOCOUTQ, and the line status register where the driver has
+	one, until the last stop bit is out; that moment ends the burst for
+	the gate and the bus occupancy stats.
+*/
+
+static void ibus_tx_arm(void);
+
+static int ibus_out_drain(void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+	int queued = 0;
+	int lsr = 0;
+
+	if (ibus.out_len > 0 || (ioctl(ibus.ifd, TIOCOUTQ, &queued) == 0 && queued > 0))
+	{
+		ibus.out_drain_tag = mainloop_timeout_add_usec((queued > 0 ? queued : 1) * BYTE_USEC, ibus_out_drain, NULL);
+		return 0;
+	}
+#ifdef TIOCSERGETLSR
+	/* the driver's queue is empty, the shift register may not be */
+	if (ioctl(ibus.ifd, TIOCSERGETLSR, &lsr) == 0 && !(lsr & TIOCSER_TEMT))
+	{
+		ibus.out_drain_tag = mainloop_timeout_add_usec(BIT_USEC, ibus_out_drain, NULL);
+		return 0;
+	}
+#endif
+
+	ibus.out_drain_tag = -1;
+	ibus.out_busy += now - ibus.out_start;
+	ibus.out_start = 0;
+
+	if (ibus.tx_end != 0 && !ibus.tx_active)
+	{
+		/* whole frame written, now we know when it really ended */
+		ibus.tx_end = now;
+		ibus.tx_not_before = now + ibus.tx_idle_bits * BIT_USEC;
+	}
+	ibus_tx_arm();
+
+	return 0;
+}
+
+static void ibus_out_writable(int condition, void *unused);
+
+static void ibus_out_flush(void)
+{
+	int n;
+
+	n = write(ibus.ifd, ibus.out_buf, ibus.out_len);
+	if (n > 0)
+	{
+		ibus.out_len -= n;
+		memmove(ibus.out_buf, ibus.out_buf + n, ibus.out_len);
+	}
+	else if (n == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		ibus_log("ibus_out: write failed: %s\n", strerror(errno));
+		ibus.out_len = 0;
+	}
+
+	if (ibus.out_len > 0)
+	{
+		ibus.out_short++;
+		if (ibus.out_tag == -1)
+		{
+			ibus.out_tag = mainloop_input_add(ibus.ifd, FIA_WRITE, ibus_out_writable, NULL);
+		}
+		return;
+	}
+
+	if (ibus.out_tag != -1)
+	{
+		mainloop_input_remove(ibus.out_tag);
+		ibus.out_tag = -1;
+	}
+	if (ibus.out_drain_tag == -1)
+	{
+		ibus.out_drain_tag = mainloop_timeout_add_usec(BYTE_USEC, ibus_out_drain, NULL);
+	}
+}
+
+static void ibus_out_writable(int condition, void *unused)
+{
+	ibus_out_flush();
+}
+
+static void ibus_out_write(const unsigned char *data, int length, uint64_t now)
+{
+	if (ibus.ifd == -1)
+	{
+		return;
+	}
+
+	if (ibus.out_len + length > sizeof(ibus.out_buf))
+	{
+		ibus_log("ibus_out: %d bytes still pending, dropping %d\n", ibus.out_len, length);
+		return;
+	}
+
+	if (ibus.out_start == 0)
+	{
+		ibus.out_start = now;
+	}
+	memcpy(ibus.out_buf + ibus.out_len, data, length);
+	ibus.out_len += length;
+
+	ibus_out_flush();
+}
+
+/* drop whatever the uart hasn't started on */
+
+static void ibus_out_discard(void)
+{
+	tcflush(ibus.ifd, TCOFLUSH);
+	ibus.out_len = 0;
+	if (ibus.out_tag != -1)
+	{
+		mainloop_input_remove(ibus.out_tag);
+		ibus.out_tag = -1;
+	}
+}
+
+static bool ibus_out_idle(void)
+{
+	return ibus.out_len == 0 && ibus.out_drain_tag == -1;
+}
+
+/*
+	Transmit gate. A frame goes out as soon as it is due and the bus has
+	been quiet for tx_idle_bits bit times since the last received byte,
+	checked against the line level (GPIO 15) right before the write.
+	When we read the port from the mainloop the frame goes out a byte
+	at a time, at most TX_WINDOW ahead of the transceiver's echo, and
+	each echoed byte is compared with what we wrote: the first mismatch
+	means someone else is talking, so we stop right there instead of
+	garbling the rest of their frame. With the rx thread the whole frame
+	is written at once and only a finished foreign frame gives the
+	collision away. Nothing new goes out before the uart has drained the
+	last frame.
+	The gate is a one-shot timer armed for the earliest moment that can
+	be true; bytes arriving in the meantime just make it re-arm when it
+	fires. Either way ours is sent again after a random backoff of up
+	to 2^n byte times, n counting the collisions in a row.
+*/
+
+static int ibus_tx_gate(void *unused);
+
+static void ibus_tx_collision(uint64_t usec, int wasted)
+{
+	int slots;
+
+	ibus.collisions++;
+	ibus.tx_wasted += wasted;
+	if (ibus.tx_backoff < TX_BACKOFF_MAX)
+	{
+		ibus.tx_backoff++;
+	}
+	slots = random() % (1 << ibus.tx_backoff);
+
+	ibus_log("ibus_tx: collision, %d bytes wasted, backing off %d bytes\n", wasted, slots);
+
+	ibus.tx_start = ibus.tx_end = 0;
+	ibus.tx_not_before = usec + ibus.tx_idle_bits * BIT_USEC + slots * BYTE_USEC;
+	ibus_queue_resend();
+	ibus_tx_arm();
+}
+
+/* keep TX_WINDOW bytes ahead of the echo */
+
+static void ibus_tx_fill(uint64_t now)
+{
+	int n = ibus.tx_echoed + TX_WINDOW - ibus.tx_written;
+
+	if (n > ibus.tx_len - ibus.tx_written)
+	{
+		n = ibus.tx_len - ibus.tx_written;
+	}
+	if (n <= 0)
+	{
+		return;
+	}
+
+	ibus_out_write(ibus.tx_frame + ibus.tx_written, n, now);
+	ibus.tx_written += n;
+	ibus.tx_last = now;
+}
+
+/* bytes read from the port while a frame is going out */
+
+static void ibus_tx_echo(const unsigned char *data, int length, uint64_t now)
 {
 	int i;
 
-	ibus_log("");
-	ibus_dump_hex(flog, msg, length, TRUE);
+	if (!ibus.tx_active)
+	{
+		return;
+	}
+
+	for (i = 0; i < length && ibus.tx_echoed < ibus.tx_written; i++)
+	{
+		if (data[i] != ibus.tx_frame[ibus.tx_echoed])
+		{
+			ibus_out_discard();
+			ibus.tx_active = FALSE;
+			ibus_tx_collision(now, ibus.tx_written);
+			return;
+		}
+		ibus.tx_echoed++;
+	}
+
+	ibus.tx_last = now;
+	if (ibus.tx_echoed == ibus.tx_len)
+	{
+		ibus.tx_end = now;
+		ibus.tx_active = FALSE;
+		ibus_tx_arm();
+		return;
+	}
+
+	ibus_tx_fill(now);
+}
+
+static void ibus_tx_arm(void)
+{
+	uint64_t due, at, now;
+
+	due = ibus_queue_due();
+	if (due == 0)
+	{
+		return;
+	}
+
+	at = __atomic_load_n(&ibus.last_byte, __ATOMIC_RELAXED) + ibus.tx_idle_bits * BIT_USEC;
+	if (at < due)
+	{
+		at = due;
+	}
+	if (at < ibus.tx_not_before)
+	{
+		at = ibus.tx_not_before;
+	}
+
+	if (ibus.tx_tag != -1)
+	{
+		if (ibus.tx_at <= at)
+		{
+			/* fires first and re-arms */
+			return;
+		}
+		mainloop_timeout_remove(ibus.tx_tag);
+	}
+
+	now = mainloop_get_usec();
+	ibus.tx_at = at;
+	ibus.tx_tag = mainloop_timeout_add_usec(at > now ? at - now : 0, ibus_tx_gate, NULL);
+}
+
+static int ibus_tx_gate(void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+	uint64_t quiet = ibus.tx_idle_bits * BIT_USEC;
+	uint64_t last, idle;
+	const unsigned char *msg;
+	int length = 0;
+
+	ibus.tx_tag = -1;
+
+	if (ibus.tx_active && now - ibus.tx_last > TX_ECHO_TIMEOUT)
+	{
+		/* no echo, the retransmit timeout takes it from here */
+		ibus_log("ibus_tx: no echo after %d of %d bytes\n", ibus.tx_echoed, ibus.tx_len);
+		ibus_out_discard();
+		ibus.tx_active = FALSE;
+	}
+
+	/* the rx thread can store a byte time later than the now read above */
+	last = __atomic_load_n(&ibus.last_byte, __ATOMIC_RELAXED);
+	idle = last < now ? now - last : 0;
+
+	if (!ibus.tx_active && ibus_out_idle() && idle >= quiet && now >= ibus.tx_not_before)
+	{
+		/* GPIO 15 (UART RX) must be high (idle) */
+		if (!gpio_read(15) || (msg = ibus_queue_take(now, &length)) == NULL)
+		{
+			length = 0;
+		}
+		else if (ibus_rx_threaded() || ibus.ifd == -1)
+		{
+			ibus_out_write(msg, length, now);
+		}
+		else
+		{
+			memcpy(ibus.tx_frame, msg, length);
+			ibus.tx_len = length;
+			ibus.tx_written = 0;
+			ibus.tx_echoed = 0;
+			ibus.tx_active = TRUE;
+			ibus_tx_fill(now);
+		}
+
+		if (length > 0)
+		{
+			ibus.tx_start = now;
+			ibus.tx_end = now + length * BYTE_USEC;
+			ibus.tx_not_before = ibus.tx_end + quiet;
+		}
+		else if (ibus_queue_due() <= now)
+		{
+			/* line busy although we heard nothing */
+			ibus.tx_not_before = now + quiet;
+		}
+	}
+
+	if (ibus.tx_active)
+	{
+		/* watch for the echo drying up */
+		ibus.tx_at = ibus.tx_last + TX_ECHO_TIMEOUT + 1;
+		ibus.tx_tag = mainloop_timeout_add_usec(TX_ECHO_TIMEOUT + 1, ibus_tx_gate, NULL);
+		return 0;
+	}
+
+	if (ibus_out_idle())
+	{
+		/* otherwise ibus_out_drain() re-arms us */
+		ibus_tx_arm();
+	}
+
+	return 0;
+}
+
+/* a foreign frame, starting at usec, that overlapped ours on the wire */
+
+static void ibus_tx_check_collision(uint64_t usec, int length)
+{
+	if (ibus.tx_end == 0 || usec >= ibus.tx_end || usec + length * BYTE_USEC <= ibus.tx_start)
+	{
+		return;
+	}
+
+	ibus_tx_collision(usec, (ibus.tx_end - ibus.tx_start) / BYTE_USEC);
+}
+
+void ibus_set_tx_idle(int bits)
+{
+	if (bits < TX_IDLE_BITS_MIN || bits > TX_IDLE_BITS_MAX)
+	{
+		return;
+	}
+	ibus.tx_idle_bits = bits;
+}
+
+static void ibus_handle_message(const unsigned char *msg, int length, uint64_t usec)
+{
+	int i;
+
+	ibus.rx_usec = usec;
+	ibus.bus_bytes += length;
+
+	if (ibus_log_text())
+	{
+		ibus_log("");
+		ibus_dump_hex(msg, length, TRUE);
+	}
 
 	/* are we entering the CDC screen? */
 	if (is_cdc_message(msg, length))
@@ -581,48 +1141,80 @@ static void ibus_handle_message(const unsigned char *msg, int length)
 		ibus.radio_msgs++;
 	}
 
-	for (i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+	i = ibus_find_event(msg, length);
+	if (i != -1)
 	{
-		if (events[i].match_length > length)
+		ibus_tx_check_collision(usec, length);
+
+		if (events[i].key && !ibus.keyboard_blocked)
 		{
-			continue;
+			keyboard_generate(events[i].key);
 		}
 
-		if (memcmp(msg, events[i].ibusmsg, events[i].match_length) == 0)
+		ibus_log("ibus event: \033[32m%s\033[m\n", events[i].desc);
+
+		if (events[i].command != NULL)
 		{
-			if (events[i].key && !ibus.keyboard_blocked)
-			{
-				keyboard_generate(events[i].key);
-			}
+			char *argv[] = { "/bin/sh", "-c", events[i].command, NULL };
 
-			ibus_log("ibus event: \033[32m%s\033[m\n", events[i].desc);
+			worker_spawn(argv, WORKER_TIMEOUT);
+		}
 
-			if (events[i].command != NULL)
-			{
-				system(events[i].command);
-			}
+		if (events[i].function != NULL)
+		{
+			events[i].function(msg, length);
+		}
+
+		capture_frame(CAPTURE_RX, usec, msg, length);
+		return;
+	}
 
-			if (events[i].function != NULL)
+	if (ibus_remove_from_queue(msg, length, usec))
+	{
+		/* came back intact, nothing collided with it */
+		if (ibus.tx_start != 0 && usec >= ibus.tx_start)
+		{
+			ibus.echo_lag_total += usec - ibus.tx_start;
+			ibus.echo_lags++;
+			if (usec - ibus.tx_start > ibus.echo_lag_max)
 			{
-				events[i].function(msg, length);
+				ibus.echo_lag_max = usec - ibus.tx_start;
 			}
-
-			return;
 		}
+		ibus.tx_start = ibus.tx_end = 0;
+		ibus.tx_backoff = 0;
+		capture_frame(CAPTURE_ECHO, usec, msg, length);
+		return;
 	}
 
-	ibus_remove_from_queue(msg, length);
+	ibus_tx_check_collision(usec, length);
+	capture_frame(CAPTURE_RX, usec, msg, length);
+}
+
+static void ibus_frame_received(const unsigned char *msg, int length, uint64_t usec)
+{
+	if (ibus_rx_threaded())
+	{
+		ibus_rx_push(msg, length, usec);
+	}
+	else
+	{
+		ibus_handle_message(msg, length, usec);
+	}
 }
 
 static void ibus_read(int condition, void *unused)
 {
-	unsigned char c;
-	uint64_t now = mainloop_get_millisec();
+	unsigned char *space;
+	uint64_t now;
+	int avail;
 	int r;
 
 	while (1)
 	{
-		if ((r = read(ibus.ifd, &c, 1)) != 1)
+		/* read as much as the tty has straight into the framer */
+		space = ibus_framer_space(&ibus.framer, &avail);
+		if ((r = read(ibus.ifd, space, avail)) <= 0)
 		{
 			if (r == -1)
 			{
@@ -636,27 +1228,34 @@ static void ibus_read(int condition, void *unused)
 			return;
 		}
 
-		if (now - ibus.last_byte > 64)
-		{
-			ibus.bufPos = 0;
-		}
-		ibus.last_byte = now;
-
-		ibus.buf[ibus.bufPos] = c;
-		if (ibus.bufPos < (sizeof(ibus.buf) - 1))
-		{
-			ibus.bufPos++;
-		}
+		now = mainloop_get_usec();
+		/* read by the idle timer on the mainloop when we run on the rx thread */
+		__atomic_store_n(&ibus.last_byte, now, __ATOMIC_RELAXED);
 
-		ibus.send_window_open = FALSE;
+		ibus_tx_echo(space, r, now);
+		ibus_framer_commit(&ibus.framer, r, now, ibus_frame_received);
 
-		if (ibus.bufPos >= 4 && ibus.buf[LENGTH] + 2 == ibus.bufPos)
+		if (r < avail)
 		{
-			ibus_handle_message(ibus.buf, ibus.bufPos);
-			ibus.bufPos = 0;
+			return;
 		}
 	}
+}
+
+/* bytes that didn't come from the serial port, e.g. a replayed log */
+
+void ibus_feed(const unsigned char *data, int length, uint64_t usec)
+{
+	__atomic_store_n(&ibus.last_byte, usec, __ATOMIC_RELAXED);
+
+	ibus_framer_feed(&ibus.framer, data, length, usec, ibus_handle_message);
+}
 
+/* the framer counters the 30s stats log, for replay reports */
+
+void ibus_get_framer_stats(unsigned int *frames, unsigned int *corrupt, unsigned int *resyncs, unsigned int *discarded, unsigned int *max_recovery)
+{
+	ibus_framer_get_stats(&ibus.framer, frames, corrupt, resyncs, discarded, max_recovery);
 }
 
 /*
@@ -673,82 +1272,168 @@ static void announce_cdc()
 		if (ibus.radio_msgs != 0)
 		{
 			RODATA cdc_announce[] = "\x18\x04\xFF\x02\x01\xE0";
-			ibus_send(ibus.ifd, cdc_announce, 6, ibus.gpio_number);
+			ibus_send(ibus.ifd, cdc_announce, 6, ibus.gpio_number, IBUS_PRIO_LOW);
 			ibus.radio_msgs = 0;
 		}
 	}
 }
 
-/* every 50ms */
+/* bytes/s each class used over the last period against its budget (0 = unlimited) */
 
-static int ibus_tick(void *unused)
+static void ibus_log_budget(const ibus_queue_stats *q, uint64_t period)
 {
-	static int i = 0;
-	static int j = 0;
+	unsigned long used[IBUS_PRIO_LEVELS];
+	unsigned long total = 0;
+	int prio;
 
-	i++;
-	if (i >= 20)
+	for (prio = 0; prio < IBUS_PRIO_LEVELS; prio++)
 	{
-		i = 0;
-		/* 5 minute idle timeout */
-		if (mainloop_get_millisec() - ibus.last_byte > 300000)
-		{
-			ibus_log("idle timeout\n");
-			power_off();
-		}
+		used[prio] = (q->bytes[prio] - ibus.budget_bytes[prio]) * 1000000ULL / period;
+		total += used[prio];
+		ibus.budget_bytes[prio] = q->bytes[prio];
 	}
 
-	if (ibus.hw_version >= 4)
+	ibus_log("tx budget: total=%lu/%dB/s urgent=%lu/%d normal=%lu/%d low=%lu/%d deferred=%u/%u/%u\n",
+		total, ibus_get_tx_budget(IBUS_BUDGET_TOTAL),
+		used[IBUS_PRIO_URGENT], ibus_get_tx_budget(IBUS_PRIO_URGENT),
+		used[IBUS_PRIO_NORMAL], ibus_get_tx_budget(IBUS_PRIO_NORMAL),
+		used[IBUS_PRIO_LOW], ibus_get_tx_budget(IBUS_PRIO_LOW),
+		q->deferred[IBUS_PRIO_URGENT], q->deferred[IBUS_PRIO_NORMAL], q->deferred[IBUS_PRIO_LOW]);
+}
+
+/*
+	Housekeeping: each job below has a timer of its own at its deadline,
+	so on a quiet bus the process sleeps until one is due. Queue expiry
+	lives in ibus-send.c, the transmit gate runs when the bus goes idle.
+*/
+
+#define IDLE_TIMEOUT 300000000ULL	/* usec without a byte before powering off */
+#define LED_ON 100			/* ms of each second */
+
+/*
+	Idle power off. Received bytes only store last_byte, possibly on
+	the rx thread; the timer moves itself on to last_byte + IDLE_TIMEOUT
+	when it finds there was traffic since it was armed.
+*/
+
+static int ibus_idle_timer(void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+	uint64_t at = __atomic_load_n(&ibus.last_byte, __ATOMIC_RELAXED) + IDLE_TIMEOUT;
+
+	if (now < at)
 	{
-		if (i < 2)
-		{
-			gpio_write(GPIO_LED_CTL, 1);
-		}
-		else
-		{
-			gpio_write(GPIO_LED_CTL, 0);
-		}
+		mainloop_timeout_add_usec(at - now, ibus_idle_timer, NULL);
+		return 0;
 	}
 
-	j++;
-	if (j >= 600)
+	ibus_log("idle timeout\n");
+	power_off();
+
+	return 0;
+}
+
+/* hw v4 heartbeat, on for LED_ON ms every second */
+
+static int ibus_led_off(void *unused)
+{
+	gpio_write(GPIO_LED_CTL, 0);
+
+	return 0;
+}
+
+static int ibus_led_timer(int overruns, void *unused)
+{
+	gpio_write(GPIO_LED_CTL, 1);
+	mainloop_timeout_add(LED_ON, ibus_led_off, NULL);
+
+	return 1;
+}
+
+static int ibus_announce_timer(int overruns, void *unused)
+{
+	announce_cdc();
+
+	return 1;
+}
+
+/* every 30s */
+
+static int ibus_stats_timer(int overruns, void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+	uint64_t period = now > ibus.stats_since ? now - ibus.stats_since : 1;
+	unsigned long wakeups = mainloop_get_wakeups();
+	unsigned int frames, corrupt, resyncs, discarded, max_recovery;
+
+	ibus_log("mainloop: wakeups=%lu %.1f/s\n", wakeups - ibus.wakeups,
+		(double) (wakeups - ibus.wakeups) * 1000000 / period);
+	ibus_get_framer_stats(&frames, &corrupt, &resyncs, &discarded, &max_recovery);
+	ibus_log("framer: frames=%u corrupt=%u resyncs=%u discarded=%u max-recovery=%u\n",
+		frames, corrupt, resyncs, discarded, max_recovery);
+	if (ibus_rx_threaded())
 	{
-		j = 0;
-		/* flush log & announce CD-changer every 30s */
-		fflush(flog);
-		if (ibus.mk3_announce)
-		{
-			announce_cdc();
-		}
+		int high_water;
+		unsigned int dropped;
 
+		ibus_rx_stats(&high_water, &dropped);
+		ibus_log("rx ring: high-water=%d dropped=%u\n", high_water, dropped);
 	}
-
-	/* every 15s */
-	if (j == 0 || j == 300)
+	if (ibus.gpio_number > 0)
 	{
-		if (!ibus.have_time)
-		{
-			ibus_request_time();
-		}
-		if (!ibus.have_date)
+		const ibus_queue_stats *q = ibus_get_queue_stats();
+
+		const ibus_dest_stats *d;
+		int dest;
+
+		ibus_log("tx queue: enqueued=%u echoed=%u retransmitted=%u expired=%u overflowed=%u failed=%u high-water=%d\n",
+			q->enqueued, q->echoed, q->retransmitted, q->expired, q->overflowed, q->failed, q->high_water);
+		ibus_log("tx echo: srtt=%lluus rttvar=%lluus rto=%lluus\n",
+			(unsigned long long) q->srtt, (unsigned long long) q->rttvar, (unsigned long long) q->rto);
+		ibus_log("tx gate: idle-bits=%d wait-mean=%lluus wait-max=%lluus collisions=%u wasted=%lu bytes\n",
+			ibus.tx_idle_bits,
+			(unsigned long long) (q->first_sends ? q->wait_total / q->first_sends : 0),
+			(unsigned long long) q->wait_max, ibus.collisions, ibus.tx_wasted);
+		ibus_log("tx uart: echo-lag-mean=%lluus echo-lag-max=%lluus short-writes=%u bus-busy=%llu%% ours=%llu%%\n",
+			(unsigned long long) (ibus.echo_lags ? ibus.echo_lag_total / ibus.echo_lags : 0),
+			(unsigned long long) ibus.echo_lag_max, ibus.out_short,
+			(unsigned long long) (ibus.bus_bytes * BYTE_USEC * 100 / period),
+			(unsigned long long) (ibus.out_busy * 100 / period));
+		ibus_log_budget(q, period);
+		for (dest = 0; dest < 256; dest++)
 		{
-			ibus_request_date();
+			d = ibus_get_dest_stats(dest);
+			if (d->sent == 0 && d->failed == 0)
+			{
+				continue;
+			}
+			ibus_log("tx to %02x: sent=%u retransmitted=%u echoed=%u failed=%u rtt=%lluus\n",
+				dest, d->sent, d->retransmitted, d->echoed, d->failed,
+				(unsigned long long) (d->rtt_samples ? d->rtt_total / d->rtt_samples : 0));
 		}
 	}
-
-	if (ibus.gpio_number > 0)
+	ibus_log("log: dropped=%u capture-dropped=%u\n", logwriter_dropped(), capture_dropped());
 	{
-		ibus_service_queue(ibus.ifd, ibus.send_window_open, ibus.gpio_number);
+		const worker_stats *ws = worker_get_stats();
 
-		/* If >50ms (2 ticks) has passed without receiving any bytes,
-		 * we have an opportunity to transmit (bus is quiet).
-		 */
+		ibus_log("worker: queued=%u dropped=%u spawned=%u spawn-failed=%u failed=%u timed-out=%u running=%d\n",
+			ws->queued, ws->dropped, ws->spawned, ws->spawn_failed, ws->failed, ws->timed_out, ws->running);
+	}
+	{
+		static const char *states[] = { "unsynced", "hunting", "locked" };
+		const timesync_stats *t = timesync_get_stats();
 
-		if (!ibus.send_window_open && ibus.bufPos == 0)
-		{
-			ibus.send_window_open = TRUE;
-		}
+		ibus_log("timesync: state=%s offset=%lldus requests=%u edges=%u steps=%u slews=%u\n",
+			states[t->state], (long long) t->offset, t->requests, t->edges, t->steps, t->slews);
 	}
+	ibus.stats_since = now;
+	ibus.wakeups = wakeups;
+	ibus.out_busy = 0;
+	ibus.bus_bytes = 0;
+	ibus.echo_lag_total = 0;
+	ibus.echo_lag_max = 0;
+	ibus.echo_lags = 0;
+	capture_flush();
 
 	return 1;
 }
@@ -773,43 +1458,49 @@ static void ibus_send_ascii(const char *cmd)
 		data[j] = strtoul(byte, NULL, 16);
 	}
 
-	ibus_send(ibus.ifd, data, j, ibus.gpio_number);
-	fflush(flog);
+	ibus_send(ibus.ifd, data, j, ibus.gpio_number, IBUS_PRIO_NORMAL);
+}
+
+static void ibus_tx_failed(const unsigned char *msg, int length, int reason)
+{
+	static const char *reasons[] = { "no echo", "expired", "queue full" };
+
+	ibus_log("ibus_send(%d): \033[31mgave up (%s)\033[m ", length, reasons[reason]);
+	ibus_dump_hex(msg, length, FALSE);
 }
 
-int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool mk3, int cdc_info_interval, int gpio_number, int hw_version)
+int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool mk3, int cdc_info_interval, int gpio_number, int hw_version, bool rx_thread, int rx_cpu, int log_mode)
 {
 	struct termios newtio;
-	struct timespec ts;
+	int i;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	ibus.start = ts.tv_sec;
+	ibus.start = mainloop_get_usec() / 1000000;
 
-	ibus.ifd = open(port, O_RDWR | O_NOCTTY);
-	if (ibus.ifd == -1)
+	/* no port: bytes come in through ibus_feed() (replay) */
+	if (port)
 	{
-		fprintf(stderr, "Can't open ibus [%s] %s\n", port, strerror(errno));
-		return -1;
-	}
+		/* non-blocking, neither reads nor writes may stall the mainloop */
+		ibus.ifd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (ibus.ifd == -1)
+		{
+			fprintf(stderr, "Can't open ibus [%s] %s\n", port, strerror(errno));
+			return -1;
+		}
 
-	memset(&newtio, 0, sizeof(newtio)); /* clear struct for new port settings */
- 	newtio.c_cflag = B9600 | CS8 | CLOCAL | CREAD | PARENB;
-	newtio.c_iflag = IGNPAR | IGNBRK;
-	newtio.c_oflag = 0;
-	newtio.c_lflag = 0;
+		memset(&newtio, 0, sizeof(newtio)); /* clear struct for new port settings */
+	 	newtio.c_cflag = B9600 | CS8 | CLOCAL | CREAD | PARENB;
+		newtio.c_iflag = IGNPAR | IGNBRK;
+		newtio.c_oflag = 0;
+		newtio.c_lflag = 0;
 
-	newtio.c_cc[VTIME] = 0;   /* inter-character timer unused */
-	newtio.c_cc[VMIN] = 0;    /* !blocking read until 1 chars received */
+		newtio.c_cc[VTIME] = 0;   /* inter-character timer unused */
+		newtio.c_cc[VMIN] = 0;    /* !blocking read until 1 chars received */
 
-	tcflush(ibus.ifd, TCIFLUSH);
-	tcsetattr(ibus.ifd, TCSANOW, &newtio);
+		tcflush(ibus.ifd, TCIFLUSH);
+		tcsetattr(ibus.ifd, TCSANOW, &newtio);
+	}
 
-#ifdef __i386__
-	flog = fopen("./ibus.txt", "a");
-#else
-	flog = fopen("/storage/ibus.txt", "a");
-#endif
-	if (flog == NULL)
+	if (logwriter_open(ibus.log_path) != 0)
 	{
 		fprintf(stderr, "Cannot write to log: %s\n", strerror(errno));
 		close(ibus.ifd);
@@ -817,10 +1508,29 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 		return -2;
 	}
 
-	ibus_log("startup bt=%d cam=%d mk3=%d cdci=%d gpio=%d hwv=%d [" __DATE__ "]\n", bluetooth, camera, mk3, cdc_info_interval, gpio_number, hw_version);
-	fflush(flog);
+	ibus.log_mode = log_mode;
+	if (log_mode & IBUS_LOG_BINARY)
+	{
+		if (capture_open(ibus.capture_path) != 0)
+		{
+			fprintf(stderr, "Cannot write to capture: %s\n", strerror(errno));
+			ibus.log_mode &= ~IBUS_LOG_BINARY;
+		}
+	}
+
+	ibus_log("startup bt=%d cam=%d mk3=%d cdci=%d gpio=%d hwv=%d rxt=%d log=%d [" __DATE__ "]\n", bluetooth, camera, mk3, cdc_info_interval, gpio_number, hw_version, rx_thread ? rx_cpu : -2, ibus.log_mode);
 
-	ibus.last_byte = mainloop_get_millisec();
+	ibus.last_byte = mainloop_get_usec();
+	ibus.stats_since = ibus.last_byte;
+	ibus_framer_init(&ibus.framer);
+	ibus_dispatch_init(&ibus.dispatch, NUM_EVENTS);
+	for (i = 0; i < NUM_EVENTS; i++)
+	{
+		ibus_dispatch_add(&ibus.dispatch, events[i].match_length, (const unsigned char *) events[i].ibusmsg);
+	}
+	ibus_set_tx_failed(ibus_tx_failed);
+	ibus_set_tx_wakeup(ibus_tx_arm);
+	srandom(mainloop_get_usec());
 	ibus.bluetooth = bluetooth;
 	ibus.have_camera = camera;
 	ibus.mk3_announce = mk3;
@@ -828,8 +1538,30 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 	ibus.gpio_number = gpio_number;
 	ibus.hw_version = hw_version;
 
-	mainloop_input_add(ibus.ifd, FIA_READ, ibus_read, NULL);
-	mainloop_timeout_add(50, ibus_tick, NULL);
+	if (ibus.ifd == -1)
+	{
+		/* fed by ibus_feed() */
+	}
+	else if (!rx_thread || ibus_rx_start(ibus.ifd, rx_cpu, ibus_read, ibus_handle_message) != 0)
+	{
+		if (rx_thread)
+		{
+			ibus_log("can't start rx thread, reading from the mainloop\n");
+		}
+		mainloop_input_add(ibus.ifd, FIA_READ, ibus_read, NULL);
+	}
+	mainloop_timeout_add_usec(IDLE_TIMEOUT, ibus_idle_timer, NULL);
+	mainloop_periodic_add(30000, ibus_stats_timer, NULL);
+	if (mk3)
+	{
+		/* when the I-Bus wakes up the CD changer announces itself every 30s */
+		mainloop_periodic_add(30000, ibus_announce_timer, NULL);
+	}
+	if (hw_version >= 4)
+	{
+		mainloop_periodic_add(1000, ibus_led_timer, NULL);
+	}
+	timesync_init(ibus_timesync_request);
 
 	/* gpio 15 is the UART RX, don't change its direction. */
 	if (gpio_number != 15 && gpio_number != 0)
@@ -872,7 +1604,7 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 		}
 
 		set[5] = set[0] ^ set[1] ^ set[2] ^ set[3] ^ set[4];
-		ibus_send(ibus.ifd, set, 6, ibus.gpio_number);
+		ibus_send(ibus.ifd, set, 6, ibus.gpio_number, IBUS_PRIO_NORMAL);
 	}
 
 	if (startup)
@@ -884,6 +1616,18 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 	return 0;
 }
 
+void ibus_set_log_paths(const char *log_path, const char *capture_path)
+{
+	if (log_path)
+	{
+		ibus.log_path = log_path;
+	}
+	if (capture_path)
+	{
+		ibus.capture_path = capture_path;
+	}
+}
+
 void ibus_cleanup(void)
 {
 	/*if (ibus.ifd != -1)
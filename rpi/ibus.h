@@ -1,5 +1,14 @@
-int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool mk3, int cdc_info_interval, int gpio_number, int hw_version);
+#define IBUS_LOG_TEXT 1		/* hex dump frames into the text log */
+#define IBUS_LOG_BINARY 2	/* record frames in the binary capture */
+
+int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool mk3, int cdc_info_interval, int gpio_number, int hw_version, bool rx_thread, int rx_cpu, int log_mode);
 void ibus_log(char *fmt, ...);
-void ibus_dump_hex(FILE *out, const unsigned char *data, int length, bool check_the_sum);
+bool ibus_log_text(void);
+void ibus_dump_hex(const unsigned char *data, int length, bool check_the_sum);
+void ibus_set_log_paths(const char *log_path, const char *capture_path);
+void ibus_set_tx_idle(int bits);
+int ibus_set_rotary_wheel(int axis, int gain);
+void ibus_feed(const unsigned char *data, int length, uint64_t usec);
+void ibus_get_framer_stats(unsigned int *frames, unsigned int *corrupt, unsigned int *resyncs, unsigned int *discarded, unsigned int *max_recovery);
 void ibus_mainloop(void);
 void ibus_cleanup(void);
@@ -0,0 +1,184 @@
+/*
+ * ibus2pcap - convert a pibus binary capture to pcapng
+ *
+ * Frames are written with LINKTYPE_USER0 (147), one interface per
+ * capture session, direction in epb_flags (echoes of our own frames are
+ * marked inbound and carry a comment).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+#define LINKTYPE_USER0 147
+
+#define BT_SHB 0x0A0D0D0A
+#define BT_IDB 0x00000001
+#define BT_EPB 0x00000006
+
+#define OPT_END 0
+#define OPT_COMMENT 1
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+
+#define EPB_INBOUND 1
+#define EPB_OUTBOUND 2
+
+
+static void put32(FILE *out, uint32_t v)
+{
+	fwrite(&v, 4, 1, out);
+}
+
+static void put16(FILE *out, uint16_t v)
+{
+	fwrite(&v, 2, 1, out);
+}
+
+static void pad(FILE *out, int length)
+{
+	static const unsigned char zero[4];
+
+	fwrite(zero, (4 - (length & 3)) & 3, 1, out);
+}
+
+static int padded(int length)
+{
+	return (length + 3) & ~3;
+}
+
+static void write_shb(FILE *out)
+{
+	put32(out, BT_SHB);
+	put32(out, 28);
+	put32(out, 0x1A2B3C4D);	/* byte-order magic */
+	put16(out, 1);
+	put16(out, 0);
+	put32(out, 0xFFFFFFFF);	/* section length unknown */
+	put32(out, 0xFFFFFFFF);
+	put32(out, 28);
+}
+
+static void write_idb(FILE *out)
+{
+	put32(out, BT_IDB);
+	put32(out, 32);
+	put16(out, LINKTYPE_USER0);
+	put16(out, 0);
+	put32(out, 0);		/* no snap length */
+	put16(out, OPT_IF_TSRESOL);
+	put16(out, 1);
+	fputc(6, out);		/* microseconds */
+	pad(out, 1);
+	put16(out, OPT_END);
+	put16(out, 0);
+	put32(out, 32);
+}
+
+static void write_epb(FILE *out, int interface, uint64_t usec, const capture_record *rec, const unsigned char *data)
+{
+	static const char echo[] = "echo";
+	int total;
+
+	total = 32 + padded(rec->length) + 8 + 4;
+	if (rec->direction == CAPTURE_ECHO)
+	{
+		total += 4 + padded(sizeof(echo) - 1);
+	}
+
+	put32(out, BT_EPB);
+	put32(out, total);
+	put32(out, interface);
+	put32(out, usec >> 32);
+	put32(out, usec & 0xFFFFFFFF);
+	put32(out, rec->length);
+	put32(out, rec->length);
+	fwrite(data, rec->length, 1, out);
+	pad(out, rec->length);
+
+	put16(out, OPT_EPB_FLAGS);
+	put16(out, 4);
+	put32(out, rec->direction == CAPTURE_TX ? EPB_OUTBOUND : EPB_INBOUND);
+	if (rec->direction == CAPTURE_ECHO)
+	{
+		put16(out, OPT_COMMENT);
+		put16(out, sizeof(echo) - 1);
+		fwrite(echo, sizeof(echo) - 1, 1, out);
+		pad(out, sizeof(echo) - 1);
+	}
+	put16(out, OPT_END);
+	put16(out, 0);
+	put32(out, total);
+}
+
+int main(int argc, char **argv)
+{
+	capture_header hdr;
+	capture_record rec;
+	unsigned char data[65536];
+	FILE *in, *out;
+	int interface = -1;
+	long frames = 0;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <capture> <output.pcapng>\n", argv[0]);
+		return -1;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in)
+	{
+		perror(argv[1]);
+		return -1;
+	}
+
+	out = fopen(argv[2], "wb");
+	if (!out)
+	{
+		perror(argv[2]);
+		fclose(in);
+		return -1;
+	}
+
+	write_shb(out);
+
+	/* records and session headers are told apart by the magic */
+	while (fread(&rec, sizeof(rec), 1, in) == 1)
+	{
+		if (memcmp(&rec, CAPTURE_MAGIC, 8) == 0)
+		{
+			memcpy(&hdr, &rec, sizeof(rec));
+			if (fread((char *) &hdr + sizeof(rec), sizeof(hdr) - sizeof(rec), 1, in) != 1 ||
+				 hdr.version != CAPTURE_VERSION)
+			{
+				fprintf(stderr, "%s: bad session header\n", argv[1]);
+				break;
+			}
+			fseek(in, hdr.header_size - sizeof(hdr), SEEK_CUR);
+
+			write_idb(out);
+			interface++;
+			continue;
+		}
+
+		if (interface < 0 || (rec.length && fread(data, rec.length, 1, in) != 1))
+		{
+			fprintf(stderr, "%s: truncated capture\n", argv[1]);
+			break;
+		}
+
+		write_epb(out, interface, hdr.realtime_usec + (rec.usec - hdr.monotonic_usec), &rec, data);
+		frames++;
+	}
+
+	fclose(in);
+	fclose(out);
+
+	printf("%ld frames\n", frames);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "keyboard.h"
+#include "stub.h"
+
+/* keyboard backend for pibus-replay: records keys instead of using uinput */
+
+
+int keyboard_init(void)
+{
+	return 0;
+}
+
+/* a batch is reported as one "key a b c" line, like the single uinput write */
+
+static char batch[240];
+static int batch_len;
+
+void keyboard_batch_key(unsigned short key)
+{
+	if (batch_len + 12 > sizeof(batch))
+	{
+		keyboard_batch_flush();
+	}
+
+	if (key & _CTRL_BIT)
+	{
+		batch_len += sprintf(batch + batch_len, " ctrl+%u", key & ~_CTRL_BIT);
+	}
+	else
+	{
+		batch_len += sprintf(batch + batch_len, " %u", key);
+	}
+}
+
+int keyboard_batch_flush(void)
+{
+	if (batch_len > 0)
+	{
+		stub_action("key%s\n", batch);
+		batch_len = 0;
+	}
+
+	return 0;
+}
+
+int keyboard_generate(unsigned short key)
+{
+	keyboard_batch_key(key);
+
+	return keyboard_batch_flush();
+}
+
+int keyboard_init_wheel(void)
+{
+	return 0;
+}
+
+int keyboard_wheel(unsigned short axis, int steps)
+{
+	stub_action("wheel %u %d\n", axis, steps);
+
+	return 0;
+}
+
+void keyboard_cleanup(void)
+{
+}
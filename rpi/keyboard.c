@@ -11,6 +11,7 @@
 
 
 static int kfd;
+static int wfd = -1;	/* wheel device, see keyboard_init_wheel() */
 
 
 int keyboard_init(void)
@@ -49,39 +50,39 @@ int keyboard_init(void)
 	return 0;
 }
 
-static int keyboard_generate_down(unsigned short key)
-{
-	struct input_event ev;
+/*
+	Key presses are collected into one input_event array and handed to
+	uinput in a single write(), so a whole gesture - a rotary burst of
+	several detents - costs one syscall instead of five per key. uinput
+	injects the events synchronously, there is nothing to sync.
+*/
 
-	memset(&ev, 0, sizeof(struct input_event));
-	ev.type = EV_KEY;
-	ev.code = key;
-	ev.value = 1;
-	if (write(kfd, &ev, sizeof(struct input_event)) < 0)
-		return -1;
+#define KEYBOARD_BATCH_MAX 80	/* 16 presses with ctrl */
 
-	return 0;
-}
+static struct input_event batch[KEYBOARD_BATCH_MAX];
+static int batch_len;
 
-static int keyboard_generate_up(unsigned short key)
+static void keyboard_batch_event(unsigned short type, unsigned short code, int value)
 {
-	struct input_event ev;
+	struct input_event *ev = &batch[batch_len++];
 
-	memset(&ev, 0, sizeof(struct input_event));
-	ev.type = EV_KEY;
-	ev.code = key;
-	ev.value = 0;
-	if (write(kfd, &ev, sizeof(struct input_event)) < 0)
-		return -1;
-
-	return 0;
+	memset(ev, 0, sizeof(struct input_event));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
 }
 
-int keyboard_generate(unsigned short key)
+/* queue a press and release, with ctrl around it if asked, as one report */
+
+void keyboard_batch_key(unsigned short key)
 {
-	struct input_event ev;
 	unsigned short mod = 0;
 
+	if (batch_len + 5 > KEYBOARD_BATCH_MAX)
+	{
+		keyboard_batch_flush();
+	}
+
 	if (key & _CTRL_BIT)
 	{
 		key &= ~(_CTRL_BIT);
@@ -89,31 +90,93 @@ int keyboard_generate(unsigned short key)
 	}
 
 	if (mod)
-	{
-		if (keyboard_generate_down(mod) < 0)
-			return -1;
-	}
+		keyboard_batch_event(EV_KEY, mod, 1);
+
+	keyboard_batch_event(EV_KEY, key, 1);
+	keyboard_batch_event(EV_KEY, key, 0);
 
-	if (keyboard_generate_down(key) < 0)
+	if (mod)
+		keyboard_batch_event(EV_KEY, mod, 0);
+
+	keyboard_batch_event(EV_SYN, SYN_REPORT, 0);
+}
+
+int keyboard_batch_flush(void)
+{
+	int len = batch_len * sizeof(struct input_event);
+
+	batch_len = 0;
+	if (len == 0)
+		return 0;
+
+	if (write(kfd, batch, len) != len)
 		return -1;
 
-	if (keyboard_generate_up(key) < 0)
+	return 0;
+}
+
+int keyboard_generate(unsigned short key)
+{
+	keyboard_batch_key(key);
+
+	return keyboard_batch_flush();
+}
+
+/*
+	Optional second device reporting the knob as a mouse wheel, so a
+	turn of several detents is one REL_WHEEL event instead of a key
+	press per detent. It is separate from the keyboard so the keyboard
+	isn't taken for a mouse.
+*/
+
+int keyboard_init_wheel(void)
+{
+	struct uinput_user_dev uidev;
+
+	wfd = open("/dev/uinput", O_WRONLY);
+	if (wfd < 0)
 		return -1;
 
-	if (mod)
-	{
-		if (keyboard_generate_up(mod) < 0)
-			return -1;
-	}
+	if (ioctl(wfd, UI_SET_EVBIT, EV_REL) < 0)
+		return -2;
+	if (ioctl(wfd, UI_SET_EVBIT, EV_SYN) < 0)
+		return -2;
+	if (ioctl(wfd, UI_SET_RELBIT, REL_WHEEL) < 0)
+		return -3;
+	if (ioctl(wfd, UI_SET_RELBIT, REL_HWHEEL) < 0)
+		return -3;
 
-	memset(&ev, 0, sizeof(struct input_event));
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
-	if (write(kfd, &ev, sizeof(struct input_event)) < 0)
-		 return -3;
+	memset(&uidev, 0, sizeof(uidev));
+	snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "uinput-ibus-wheel");
+	uidev.id.bustype = BUS_USB;
+	uidev.id.vendor  = 0x1;
+	uidev.id.product = 0x2;
+	uidev.id.version = 1;
 
-	fdatasync(kfd);
+	if (write(wfd, &uidev, sizeof(uidev)) < 0)
+		return -4;
+
+	if (ioctl(wfd, UI_DEV_CREATE) < 0)
+		return -5;
+
+	return 0;
+}
+
+/* axis is REL_WHEEL or REL_HWHEEL, steps > 0 is up/right */
+
+int keyboard_wheel(unsigned short axis, int steps)
+{
+	struct input_event ev[2];
+
+	memset(ev, 0, sizeof(ev));
+	ev[0].type = EV_REL;
+	ev[0].code = axis;
+	ev[0].value = steps;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+
+	if (write(wfd, ev, sizeof(ev)) != sizeof(ev))
+		return -1;
 
 	return 0;
 }
@@ -124,4 +187,11 @@ void keyboard_cleanup(void)
 
 	close(kfd);
 	kfd = -1;
+
+	if (wfd != -1)
+	{
+		ioctl(wfd, UI_DEV_DESTROY);
+		close(wfd);
+		wfd = -1;
+	}
 }
@@ -1,4 +1,8 @@
 int keyboard_init(void);
 int keyboard_generate(unsigned short key);
+void keyboard_batch_key(unsigned short key);
+int keyboard_batch_flush(void);
+int keyboard_init_wheel(void);
+int keyboard_wheel(unsigned short axis, int steps);
 void keyboard_cleanup(void);
 #define _CTRL_BIT 0x8000
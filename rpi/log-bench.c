@@ -0,0 +1,164 @@
+/*
+ * log-bench - frame handling latency while the log device is slow
+ *
+ * Frames come in every FRAME_USEC and each is logged the way a handled
+ * frame is: the hex dump and the event line. The log goes to a FIFO that
+ * a thread drains at only DEVICE_BYTES_SEC, far less than the log
+ * produces, like an SD card stalled on erase. The time spent logging
+ * each frame is measured, once through stdio with the old 50 ms fflush(),
+ * and once through the logwriter ring. Prints p50/p99/max per frame and
+ * the lines the logwriter dropped.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "mainloop.h"
+#include "logwriter.h"
+
+#define FRAMES 2000
+#define FRAME_USEC 2000
+#define FLUSH_USEC 50000	/* the old ibus_tick() fflush() */
+#define DEVICE_BYTES_SEC 16384
+#define DEVICE_CHUNK 512
+
+static struct
+{
+	char path[64];
+	bool draining;		/* stop throttling, read to the end */
+	uint64_t lat[FRAMES];
+}
+lb =
+{
+	.draining = FALSE,
+};
+
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the slow device */
+static void *device(void *unused)
+{
+	char buf[DEVICE_CHUNK];
+	int fd = open(lb.path, O_RDONLY);
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+	{
+		if (!__atomic_load_n(&lb.draining, __ATOMIC_RELAXED))
+			usleep(1000000LL * DEVICE_CHUNK / DEVICE_BYTES_SEC);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int format_frame(char *buf, int i)
+{
+	return sprintf(buf, "%6.6d 80 0A BF 13 03 00 00 00 00 00 00 25\n"
+		"%6.6d ibus event: \033[32mIKE speed/rpm %d\033[m\n", i / 500, i / 500, i);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, bool stdio)
+{
+	struct timespec t;
+	pthread_t thread;
+	uint64_t t0, last_flush = 0;
+	char buf[256];
+	FILE *out = NULL;
+	int i, len;
+
+	snprintf(lb.path, sizeof(lb.path), "/tmp/log-bench.%d", getpid());
+	unlink(lb.path);
+	if (mkfifo(lb.path, 0600) < 0)
+	{
+		perror(lb.path);
+		exit(1);
+	}
+	lb.draining = FALSE;
+	pthread_create(&thread, NULL, device, NULL);
+
+	if (stdio)
+		out = fopen(lb.path, "a");
+	else if (logwriter_open(lb.path) != 0)
+		out = NULL;
+	if (stdio && !out)
+	{
+		perror(lb.path);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < FRAMES; i++)
+	{
+		t.tv_nsec += FRAME_USEC * 1000;
+		if (t.tv_nsec >= 1000000000)
+		{
+			t.tv_nsec -= 1000000000;
+			t.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+
+		t0 = now_nsec();
+		len = format_frame(buf, i);
+		if (stdio)
+		{
+			fwrite(buf, len, 1, out);
+			if (t0 - last_flush > FLUSH_USEC * 1000ULL)
+			{
+				fflush(out);
+				last_flush = t0;
+			}
+		}
+		else
+		{
+			logwriter_write(buf, len);
+		}
+		lb.lat[i] = now_nsec() - t0;
+	}
+
+	__atomic_store_n(&lb.draining, TRUE, __ATOMIC_RELAXED);
+	if (stdio)
+		fclose(out);
+	else
+		logwriter_close();
+	pthread_join(thread, NULL);
+	unlink(lb.path);
+
+	qsort(lb.lat, FRAMES, sizeof(uint64_t), cmp_u64);
+	printf("%-9s p50 %8.1f us  p99 %8.1f us  max %8.1f us", name,
+		lb.lat[FRAMES / 2] / 1e3, lb.lat[FRAMES * 99 / 100] / 1e3, lb.lat[FRAMES - 1] / 1e3);
+	if (stdio)
+		printf("\n");
+	else
+		printf("  dropped %u of %d\n", logwriter_dropped(), FRAMES);
+}
+
+int main(int argc, char *argv[])
+{
+	printf("%d frames every %d us, log device at %d bytes/s:\n", FRAMES, FRAME_USEC, DEVICE_BYTES_SEC);
+	run("stdio", TRUE);
+	run("logwriter", FALSE);
+
+	return 0;
+}
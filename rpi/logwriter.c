@@ -0,0 +1,185 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "mainloop.h"
+#include "logwriter.h"
+
+/*
+	Log records are queued from the mainloop into a bounded
+	single-producer/single-consumer ring and written out by a background
+	thread with writev(), a batch at a time. A slow SD card therefore
+	stalls only this thread. When the ring is full the record is dropped
+	and counted, the mainloop never waits.
+*/
+
+#define LOG_RING_SIZE 128	/* power of 2 */
+#define LOG_BATCH 32
+
+typedef struct
+{
+	int length;
+	char data[LOG_RECORD_MAX];
+}
+log_record;
+
+static struct
+{
+	log_record ring[LOG_RING_SIZE];
+	unsigned int head;	/* written by the mainloop only */
+	unsigned int tail;	/* written by the writer thread only */
+	bool sleeping;		/* writer is about to wait on efd */
+
+	int fd;
+	int efd;
+	bool closing;
+	pthread_t thread;
+
+	unsigned int dropped;
+}
+lw =
+{
+	.head = 0,
+	.tail = 0,
+	.sleeping = FALSE,
+	.fd = -1,
+	.efd = -1,
+	.closing = FALSE,
+	.dropped = 0,
+};
+
+
+static void *logwriter_thread(void *unused)
+{
+	struct iovec iov[LOG_BATCH];
+	unsigned int head, tail;
+	uint64_t count;
+	int n;
+
+	tail = lw.tail;
+
+	while (1)
+	{
+		head = __atomic_load_n(&lw.head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			if (__atomic_load_n(&lw.closing, __ATOMIC_ACQUIRE))
+				break;
+
+			/*
+				Say we are going to sleep, then look once more: either
+				logwriter_write() sees the flag after storing head and
+				wakes us, or we see its record here. Both sides seq_cst.
+			*/
+			__atomic_store_n(&lw.sleeping, TRUE, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&lw.head, __ATOMIC_SEQ_CST) == tail)
+			{
+				read(lw.efd, &count, sizeof(count));
+			}
+			__atomic_store_n(&lw.sleeping, FALSE, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		for (n = 0; n < LOG_BATCH && tail + n != head; n++)
+		{
+			iov[n].iov_base = lw.ring[(tail + n) & (LOG_RING_SIZE - 1)].data;
+			iov[n].iov_len = lw.ring[(tail + n) & (LOG_RING_SIZE - 1)].length;
+		}
+
+		while (writev(lw.fd, iov, n) < 0 && errno == EINTR)
+			;
+
+		tail += n;
+		__atomic_store_n(&lw.tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+int logwriter_open(const char *path)
+{
+	lw.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (lw.fd == -1)
+	{
+		return -1;
+	}
+
+	lw.efd = eventfd(0, EFD_CLOEXEC);
+	if (lw.efd == -1 || pthread_create(&lw.thread, NULL, logwriter_thread, NULL) != 0)
+	{
+		close(lw.fd);
+		lw.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void logwriter_write(const char *data, int length)
+{
+	unsigned int head = lw.head;
+	unsigned int tail = __atomic_load_n(&lw.tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	log_record *rec;
+
+	if (lw.fd == -1)
+	{
+		return;
+	}
+
+	if (head - tail >= LOG_RING_SIZE)
+	{
+		lw.dropped++;
+		return;
+	}
+
+	if (length > LOG_RECORD_MAX)
+	{
+		length = LOG_RECORD_MAX;
+	}
+
+	rec = &lw.ring[head & (LOG_RING_SIZE - 1)];
+	memcpy(rec->data, data, length);
+	rec->length = length;
+
+	__atomic_store_n(&lw.head, head + 1, __ATOMIC_SEQ_CST);
+
+	/* only wake the writer when it is asleep or about to be */
+	if (__atomic_load_n(&lw.sleeping, __ATOMIC_SEQ_CST))
+	{
+		write(lw.efd, &one, sizeof(one));
+	}
+}
+
+unsigned int logwriter_dropped(void)
+{
+	return lw.dropped;
+}
+
+/* write out everything queued so far, then stop */
+
+void logwriter_close(void)
+{
+	uint64_t one = 1;
+
+	if (lw.fd == -1)
+	{
+		return;
+	}
+
+	__atomic_store_n(&lw.closing, TRUE, __ATOMIC_RELEASE);
+	write(lw.efd, &one, sizeof(one));
+	pthread_join(lw.thread, NULL);
+
+	fdatasync(lw.fd);
+	close(lw.fd);
+	close(lw.efd);
+	lw.fd = -1;
+	lw.efd = -1;
+}
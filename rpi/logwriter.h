@@ -0,0 +1,6 @@
+#define LOG_RECORD_MAX 1024
+
+int logwriter_open(const char *path);
+void logwriter_write(const char *data, int length);
+unsigned int logwriter_dropped(void);
+void logwriter_close(void);
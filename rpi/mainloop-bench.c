@@ -0,0 +1,206 @@
+/*
+ * mainloop-bench - host checks for the mainloop timers
+ *
+ *   drift     a periodic timer runs DRIFT_TICKS ticks on the real clock
+ *             while its own callback and an unrelated timeout burn random
+ *             amounts of CPU, some of them longer than the period. Every
+ *             tick must be accounted for, called or counted in overruns,
+ *             and the last one must still land on the original grid, less
+ *             than one period late. Exit status is 1 if not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mainloop.h"
+
+#define DRIFT_TICKS 10000
+#define DRIFT_PERIOD 2000	/* usec */
+#define DRIFT_SLOW_EVERY 97	/* every so many ticks the callback runs long */
+
+#define FDS_MAX 256
+#define FDS_PASSES 200000
+
+static struct
+{
+	uint64_t start;
+	long ticks;		/* grid slots passed, calls plus overruns */
+	long calls;
+	long overruns;
+	uint64_t late_max;
+	uint64_t late_last;
+} drift = {
+	.start = 0,
+	.ticks = 0,
+	.calls = 0,
+	.overruns = 0,
+	.late_max = 0,
+	.late_last = 0,
+};
+
+
+static void busy(uint64_t usec)
+{
+	uint64_t until = mainloop_get_usec() + usec;
+
+	while (mainloop_get_usec() < until)
+		;
+}
+
+static int drift_tick(int overruns, void *data)
+{
+	uint64_t late;
+
+	drift.calls++;
+	drift.overruns += overruns;
+	drift.ticks += 1 + overruns;
+
+	late = mainloop_get_usec() - (drift.start + (uint64_t) drift.ticks * DRIFT_PERIOD);
+	drift.late_last = late;
+	if (late > drift.late_max)
+		drift.late_max = late;
+
+	if (drift.ticks >= DRIFT_TICKS)
+	{
+		mainloop_exit();
+		return 0;
+	}
+
+	/* up to 40% of the period, and now and then two and a half periods */
+	if (drift.calls % DRIFT_SLOW_EVERY == 0)
+		busy(DRIFT_PERIOD * 5 / 2);
+	else
+		busy(rand() % (DRIFT_PERIOD * 2 / 5));
+	return 1;
+}
+
+/* somebody else's callback getting in the way */
+static int drift_noise(void *data)
+{
+	busy(rand() % DRIFT_PERIOD);
+	mainloop_timeout_add_usec(DRIFT_PERIOD / 2 + rand() % (DRIFT_PERIOD * 3), drift_noise, NULL);
+	return 0;
+}
+
+static int bench_drift(void)
+{
+	bool ok;
+
+	srand(1);
+	drift.start = mainloop_get_usec();
+	mainloop_periodic_add_usec(DRIFT_PERIOD, drift_tick, NULL);
+	mainloop_timeout_add_usec(DRIFT_PERIOD, drift_noise, NULL);
+	mainloop();
+
+	/* the tick counted as slot n is due at start + n periods */
+	ok = drift.ticks >= DRIFT_TICKS && drift.late_last < DRIFT_PERIOD;
+	printf("drift: %d ticks of %d us: %ld calls + %ld overruns, %.1f s\n",
+		DRIFT_TICKS, DRIFT_PERIOD, drift.calls, drift.overruns,
+		(mainloop_get_usec() - drift.start) / 1e6);
+	printf("drift: last tick %llu us late, worst dispatch %llu us: %s\n",
+		(unsigned long long) drift.late_last, (unsigned long long) drift.late_max,
+		ok ? "ok" : "DRIFTED");
+	return ok ? 0 : 1;
+}
+
+static struct
+{
+	int n;
+	int pipes[FDS_MAX][2];
+	long passes;
+} fds = {
+	.n = 0,
+	.passes = 0,
+};
+
+static void fds_pass(int condition, void *data)
+{
+	int i = (int) (intptr_t) data;
+	char c;
+
+	if (read(fds.pipes[i][0], &c, 1) != 1)
+		return;
+	if (++fds.passes >= FDS_PASSES)
+	{
+		mainloop_exit();
+		return;
+	}
+	if (write(fds.pipes[(i + 1) % fds.n][1], &c, 1) != 1)
+		mainloop_exit();
+}
+
+static double cpu_sec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void fds_run(int n)
+{
+	int tags[FDS_MAX];
+	uint64_t t0;
+	double cpu0;
+	int i;
+
+	fds.n = n;
+	fds.passes = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (pipe(fds.pipes[i]) < 0)
+		{
+			perror("pipe");
+			exit(1);
+		}
+		tags[i] = mainloop_input_add(fds.pipes[i][0], FIA_READ, fds_pass, (void *) (intptr_t) i);
+	}
+
+	t0 = mainloop_get_usec();
+	cpu0 = cpu_sec();
+	if (write(fds.pipes[0][1], "x", 1) != 1)
+		exit(1);
+	mainloop();
+
+	printf("fds %3d: %.2f us wall, %.2f us cpu per wakeup\n", n,
+		(double) (mainloop_get_usec() - t0) / FDS_PASSES,
+		(cpu_sec() - cpu0) * 1e6 / FDS_PASSES);
+
+	for (i = 0; i < n; i++)
+	{
+		mainloop_input_remove(tags[i]);
+		close(fds.pipes[i][0]);
+		close(fds.pipes[i][1]);
+	}
+}
+
+static int bench_fds(void)
+{
+#ifdef MAINLOOP_USE_SELECT
+	printf("fds: select, %d passes\n", FDS_PASSES);
+#else
+	printf("fds: epoll, %d passes\n", FDS_PASSES);
+#endif
+	fds_run(1);
+	fds_run(16);
+	fds_run(256);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	mainloop_init();
+
+	if (argc > 1 && strcmp(argv[1], "drift") == 0)
+		return bench_drift();
+	if (argc > 1 && strcmp(argv[1], "fds") == 0)
+		return bench_fds();
+
+	fprintf(stderr, "usage: %s drift|fds\n", argv[0]);
+	return 2;
+}
@@ -7,85 +7,257 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <time.h>
+#ifndef MAINLOOP_USE_SELECT
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 #include "mainloop.h"
 #include "slist.h"
 
 
-static SList *tmr_list;		  /* timer list */
+#define TMR_HASH_SIZE 64	/* power of 2 */
+
+static timerevent **tmr_heap;	  /* binary min-heap ordered by next_call */
+static int tmr_heap_len;
+static int tmr_heap_size;
+static timerevent *tmr_hash[TMR_HASH_SIZE];	/* tag -> timer */
+static timerevent *tmr_running;	  /* timer whose callback is executing */
+static bool tmr_running_removed;
 static int tmr_list_count;
 static SList *se_list;			  /* socket event list */
 static int se_list_count;
 static int done = FALSE;		  /* finished ? */
+static bool virtual_clock = FALSE;	  /* time only moves when told to */
+static uint64_t virtual_usec;
+static unsigned long wakeups;		  /* times the loop woke up, see mainloop_get_wakeups() */
 
 
-uint64_t mainloop_get_millisec(void)
+uint64_t mainloop_get_nsec(void)
 {
-#if 0
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return (now.tv_sec * 1000) + (now.tv_usec / 1000);
-#else
 	struct timespec now;
+
+	if (virtual_clock)
+		return virtual_usec * 1000;
+
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	return (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
-#endif
+	return ((uint64_t) now.tv_sec * 1000000000) + now.tv_nsec;
 }
 
-void mainloop_timeout_remove(int tag)
+uint64_t mainloop_get_usec(void)
+{
+	struct timespec now;
+
+	if (virtual_clock)
+		return virtual_usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+uint64_t mainloop_get_millisec(void)
+{
+	return mainloop_get_usec() / 1000;
+}
+
+static void tmr_heap_set(int index, timerevent *te)
+{
+	tmr_heap[index] = te;
+	te->heap_index = index;
+}
+
+static void tmr_heap_sift_up(int index)
 {
+	timerevent *te = tmr_heap[index];
+	int parent;
+
+	while (index > 0)
+	{
+		parent = (index - 1) / 2;
+		if (tmr_heap[parent]->next_call <= te->next_call)
+			break;
+		tmr_heap_set(index, tmr_heap[parent]);
+		index = parent;
+	}
+	tmr_heap_set(index, te);
+}
+
+static void tmr_heap_sift_down(int index)
+{
+	timerevent *te = tmr_heap[index];
+	int child;
+
+	while ((child = index * 2 + 1) < tmr_heap_len)
+	{
+		if (child + 1 < tmr_heap_len &&
+			 tmr_heap[child + 1]->next_call < tmr_heap[child]->next_call)
+			child++;
+		if (te->next_call <= tmr_heap[child]->next_call)
+			break;
+		tmr_heap_set(index, tmr_heap[child]);
+		index = child;
+	}
+	tmr_heap_set(index, te);
+}
+
+static void tmr_heap_insert(timerevent *te)
+{
+	if (tmr_heap_len == tmr_heap_size)
+	{
+		tmr_heap_size = tmr_heap_size ? tmr_heap_size * 2 : 16;
+		tmr_heap = realloc(tmr_heap, tmr_heap_size * sizeof(timerevent *));
+	}
+
+	tmr_heap_set(tmr_heap_len, te);
+	tmr_heap_len++;
+	tmr_heap_sift_up(te->heap_index);
+}
+
+static void tmr_heap_delete(timerevent *te)
+{
+	int index = te->heap_index;
+
+	tmr_heap_len--;
+	if (index != tmr_heap_len)
+	{
+		/* move the last leaf into the hole, then restore heap order */
+		tmr_heap_set(index, tmr_heap[tmr_heap_len]);
+		tmr_heap_sift_up(index);
+		tmr_heap_sift_down(tmr_heap[index]->heap_index);
+	}
+	te->heap_index = -1;
+}
+
+/* re-position a queued timer after its next_call was changed */
+static void tmr_heap_update(timerevent *te)
+{
+	tmr_heap_sift_up(te->heap_index);
+	tmr_heap_sift_down(te->heap_index);
+}
+
+static timerevent *tmr_hash_unlink(int tag)
+{
+	timerevent **link;
 	timerevent *te;
-	SList *list;
 
-	list = tmr_list;
-	while (list)
+	link = &tmr_hash[tag & (TMR_HASH_SIZE - 1)];
+	while ((te = *link))
 	{
-		te = (timerevent *) list->data;
 		if (te->tag == tag)
 		{
-			tmr_list = slist_remove(tmr_list, te);
-			free(te);
-			return;
+			*link = te->hash_next;
+			return te;
 		}
-		list = list->next;
+		link = &te->hash_next;
 	}
+
+	return NULL;
 }
 
-int mainloop_timeout_add(int interval, timer_callback callback, void *userdata)
+void mainloop_timeout_remove(int tag)
+{
+	timerevent *te;
+
+	te = tmr_hash_unlink(tag);
+	if (!te)
+		return;
+
+	if (te->heap_index != -1)
+		tmr_heap_delete(te);
+
+	/* the loop still holds this one, it frees it after the callback returns */
+	if (te == tmr_running)
+	{
+		tmr_running_removed = TRUE;
+		return;
+	}
+
+	free(te);
+}
+
+static timerevent *tmr_new(uint64_t interval, void *userdata)
 {
 	timerevent *te = malloc(sizeof (timerevent));
+	timerevent **bucket;
 
 	tmr_list_count++;	/* this overflows at 2.2Billion, who cares!! */
 
 	te->tag = tmr_list_count;
 	te->interval = interval;
-	te->callback = callback;
+	te->callback = NULL;
+	te->pcallback = NULL;
+	te->periodic = FALSE;
 	te->userdata = userdata;
 
-	te->next_call = mainloop_get_millisec() + te->interval;
+	te->next_call = mainloop_get_usec() + te->interval;
+
+	bucket = &tmr_hash[te->tag & (TMR_HASH_SIZE - 1)];
+	te->hash_next = *bucket;
+	*bucket = te;
+
+	tmr_heap_insert(te);
+
+	return te;
+}
+
+int mainloop_timeout_add_usec(uint64_t interval, timer_callback callback, void *userdata)
+{
+	timerevent *te = tmr_new(interval, userdata);
 
-	tmr_list = slist_prepend(tmr_list, te);
+	te->callback = callback;
 
 	return te->tag;
 }
 
+int mainloop_timeout_add(int interval, timer_callback callback, void *userdata)
+{
+	return mainloop_timeout_add_usec((uint64_t) interval * 1000, callback, userdata);
+}
+
+/* Like mainloop_timeout_add(), but calls are kept on a fixed grid of
+ * start + n * interval, no matter how late each one is dispatched. If
+ * whole periods were missed they are skipped and counted in overruns. */
+int mainloop_periodic_add_usec(uint64_t interval, periodic_callback callback, void *userdata)
+{
+	timerevent *te;
+
+	if (interval == 0)
+		return -1;
+
+	te = tmr_new(interval, userdata);
+	te->pcallback = callback;
+	te->periodic = TRUE;
+
+	return te->tag;
+}
+
+int mainloop_periodic_add(int interval, periodic_callback callback, void *userdata)
+{
+	if (interval <= 0)
+		return -1;
+
+	return mainloop_periodic_add_usec((uint64_t) interval * 1000, callback, userdata);
+}
+
 /*void mainloop_timeout_override_nextcall(int tag, uint64_t next_call)
 {
 	timerevent *te;
-	SList *list;
 
-	list = tmr_list;
-	while (list)
+	te = tmr_hash[tag & (TMR_HASH_SIZE - 1)];
+	while (te)
 	{
-		te = (timerevent *) list->data;
 		if (te->tag == tag)
 		{
 			te->next_call = next_call;
+			if (te->heap_index != -1)
+				tmr_heap_update(te);
 			return;
 		}
-		list = list->next;
+		te = te->hash_next;
 	}
 }*/
 
+#ifdef MAINLOOP_USE_SELECT
+
 void mainloop_input_remove(int tag)
 {
 	socketevent *se;
@@ -105,154 +277,493 @@ void mainloop_input_remove(int tag)
 	}
 }
 
-int mainloop_input_add(int sok, int flags, socket_callback func, void *data)
+static void se_register(socketevent *se)
 {
-	socketevent *se = malloc(sizeof(socketevent));
-
-	se_list_count++;	/* this overflows at 2.2Billion, who cares!! */
-
-	se->tag = se_list_count;
-	se->sok = sok;
-	se->rread = flags & FIA_READ;
-	se->wwrite = flags & FIA_WRITE;
-	se->eexcept = flags & FIA_EX;
-	se->callback = func;
-	se->userdata = data;
 	se_list = slist_prepend(se_list, se);
-
-	return se->tag;
-}
-
-void mainloop_init(void)
-{
-	tmr_list = NULL;
-	se_list = NULL;
-
-	tmr_list_count = 0;
-	se_list_count = 0;
 }
 
-void mainloop(void)
+/* wait for input until the absolute deadline (0 = no timers) */
+static bool mainloop_poll_inputs(uint64_t deadline)
 {
 	struct timeval timeout;
+	struct timeval *ptimeout;
 	socketevent *se;
-	timerevent *te;
-	int nfds;
+	int nfds, n;
 	fd_set rd, wd, ex;
 	SList *list;
-	uint64_t shortest, delay;
-	uint64_t ms;
+	uint64_t delay;
+	uint64_t us;
 
-	while (!done)
+	ptimeout = &timeout;
+	us = mainloop_get_usec();
+	if (deadline == 0)
+	{
+		ptimeout = NULL;
+	}
+	else if (deadline > us)
+	{
+		delay = deadline - us;
+		timeout.tv_sec = delay / 1000000;
+		timeout.tv_usec = delay % 1000000;
+	}
+	else
+	{
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+	}
+
+	nfds = 0;
+	FD_ZERO(&rd);
+	FD_ZERO(&wd);
+	FD_ZERO(&ex);
+
+	list = se_list;
+	while (list)
 	{
-		nfds = 0;
-		FD_ZERO(&rd);
-		FD_ZERO(&wd);
-		FD_ZERO(&ex);
+		se = (socketevent *) list->data;
+		if (se->rread)
+			FD_SET(se->sok, &rd);
+		if (se->wwrite)
+			FD_SET(se->sok, &wd);
+		if (se->eexcept)
+			FD_SET(se->sok, &ex);
+		if (se->sok > nfds)
+			nfds = se->sok;
+		list = list->next;
+	}
 
+	n = select(nfds + 1, &rd, &wd, &ex, ptimeout);
+
+	/* set all checked flags to false */
+	list = se_list;
+	while (list)
+	{
+		se = (socketevent *) list->data;
+		se->checked = 0;
+		list = list->next;
+	}
+
+	/* check all the socket callbacks */
+	list = se_list;
+	while (list)
+	{
+		se = (socketevent *) list->data;
+		se->checked = 1;
+		if (se->rread && FD_ISSET(se->sok, &rd))
+		{
+			se->callback(FIA_READ, se->userdata);
+		}
+		else if (se->wwrite && FD_ISSET(se->sok, &wd))
+		{
+			se->callback(FIA_WRITE, se->userdata);
+		}
+		else if (se->eexcept && FD_ISSET(se->sok, &ex))
+		{
+			se->callback(FIA_EX, se->userdata);
+		}
 		list = se_list;
-		while (list)
+		if (list)
 		{
 			se = (socketevent *) list->data;
+			while (se->checked)
+			{
+				list = list->next;
+				if (!list)
+					break;
+				se = (socketevent *) list->data;
+			}
+		}
+	}
+
+	return n > 0;
+}
+
+#else
+
+#define EPOLL_MAX_EVENTS 32
+
+static int epfd = -1;
+static int tfd = -1;				  /* timerfd armed at the next timer deadline */
+static uint64_t tfd_armed;		  /* deadline tfd is currently armed for */
+static SList **fd_table;		  /* fd -> list of socketevents on that fd */
+static int fd_table_size;
+static SList *se_dead;			  /* removed during dispatch, freed afterwards */
+
+/* (re)program epoll with the union of all flags wanted on this fd */
+static void se_update_fd(int fd, bool existed)
+{
+	struct epoll_event ev;
+	socketevent *se;
+	SList *list;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	list = fd_table[fd];
+	while (list)
+	{
+		se = (socketevent *) list->data;
+		if (!se->dead)
+		{
 			if (se->rread)
-				FD_SET(se->sok, &rd);
+				ev.events |= EPOLLIN;
 			if (se->wwrite)
-				FD_SET(se->sok, &wd);
+				ev.events |= EPOLLOUT;
 			if (se->eexcept)
-				FD_SET(se->sok, &ex);
-			if (se->sok > nfds)
-				nfds = se->sok;
-			list = list->next;
+				ev.events |= EPOLLPRI;
 		}
+		list = list->next;
+	}
 
-		/* find the shortest timeout event */
-		shortest = 0;
-		list = tmr_list;
-		while (list)
+	if (ev.events == 0)
+	{
+		if (existed)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+	}
+	else if (existed)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+	else
+	{
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+static void mainloop_epoll_init(void)
+{
+	struct epoll_event ev;
+
+	if (epfd != -1)
+		return;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	/* timers wake us through an absolute CLOCK_MONOTONIC timerfd, so
+	 * deadlines aren't rounded to epoll_wait()'s relative milliseconds */
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd != -1)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = tfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+	}
+	tfd_armed = 0;
+}
+
+static bool se_fd_active(int fd)
+{
+	SList *list;
+
+	for (list = fd_table[fd]; list; list = list->next)
+	{
+		if (!((socketevent *) list->data)->dead)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+void mainloop_input_remove(int tag)
+{
+	socketevent *se;
+	SList *list;
+
+	list = se_list;
+	while (list)
+	{
+		se = (socketevent *) list->data;
+		if (se->tag == tag)
 		{
-			te = (timerevent *) list->data;
-			if (te->next_call < shortest || shortest == 0)
-				shortest = te->next_call;
-			list = list->next;
+			se_list = slist_remove(se_list, se);
+
+			/* epoll may still hand it to us this iteration, free it later */
+			se->dead = 1;
+			se_update_fd(se->sok, TRUE);
+			se_dead = slist_prepend(se_dead, se);
+			return;
 		}
+		list = list->next;
+	}
+}
+
+static void se_register(socketevent *se)
+{
+	bool existed;
+	int size;
+
+	mainloop_epoll_init();
 
-		ms = mainloop_get_millisec();
-		if (shortest > ms)
+	if (se->sok >= fd_table_size)
+	{
+		size = fd_table_size ? fd_table_size : 16;
+		while (se->sok >= size)
+			size *= 2;
+		fd_table = realloc(fd_table, size * sizeof(SList *));
+		memset(fd_table + fd_table_size, 0, (size - fd_table_size) * sizeof(SList *));
+		fd_table_size = size;
+	}
+
+	existed = se_fd_active(se->sok);
+	se_list = slist_prepend(se_list, se);
+	fd_table[se->sok] = slist_prepend(fd_table[se->sok], se);
+	se_update_fd(se->sok, existed);
+}
+
+static void se_free_dead(void)
+{
+	socketevent *se;
+
+	while (se_dead)
+	{
+		se = (socketevent *) se_dead->data;
+		se_dead = slist_remove(se_dead, se);
+		fd_table[se->sok] = slist_remove(fd_table[se->sok], se);
+		free(se);
+	}
+}
+
+/* wait for input until the absolute deadline (0 = no timers) */
+static bool mainloop_poll_inputs(uint64_t deadline)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct itimerspec its;
+	socketevent *se;
+	SList *list;
+	uint64_t expirations;
+	uint64_t us;
+	int timeout_ms;
+	int i, n;
+	bool ready = FALSE;
+
+	mainloop_epoll_init();
+
+	timeout_ms = -1;
+	if (deadline != 0)
+	{
+		us = mainloop_get_usec();
+		if (deadline <= us)
 		{
-			delay = shortest - ms;
-			timeout.tv_sec = delay / 1000;
-			timeout.tv_usec = (delay % 1000) * 1000;
+			timeout_ms = 0;
 		}
-		else
+		else if (tfd == -1)
 		{
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 0;
+			/* round up, epoll only has millisecond resolution */
+			timeout_ms = (deadline - us + 999) / 1000;
 		}
+		else if (deadline != tfd_armed)
+		{
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = deadline / 1000000;
+			its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+			timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+			tfd_armed = deadline;
+		}
+	}
 
-		select(nfds + 1, &rd, &wd, &ex, &timeout);
+	n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, timeout_ms);
 
-		/* set all checked flags to false */
-		list = se_list;
-		while (list)
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].data.fd == tfd)
 		{
-			se = (socketevent *) list->data;
-			se->checked = 0;
-			list = list->next;
+			read(tfd, &expirations, sizeof(expirations));
+			tfd_armed = 0;
+			continue;
 		}
 
-		/* check all the socket callbacks */
-		list = se_list;
+		ready = TRUE;
+		list = fd_table[events[i].data.fd];
 		while (list)
 		{
 			se = (socketevent *) list->data;
-			se->checked = 1;
-			if (se->rread && FD_ISSET(se->sok, &rd))
+			list = list->next;
+
+			if (se->dead)
+				continue;
+
+			/* errors and hangups are reported as readable, like select() */
+			if (se->rread && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
 			{
 				se->callback(FIA_READ, se->userdata);
 			}
-			else if (se->wwrite && FD_ISSET(se->sok, &wd))
+			else if (se->wwrite && (events[i].events & (EPOLLOUT | EPOLLERR)))
 			{
 				se->callback(FIA_WRITE, se->userdata);
 			}
-			else if (se->eexcept && FD_ISSET(se->sok, &ex))
+			else if (se->eexcept && (events[i].events & EPOLLPRI))
 			{
 				se->callback(FIA_EX, se->userdata);
 			}
-			list = se_list;
-			if (list)
+		}
+	}
+
+	se_free_dead();
+
+	return ready;
+}
+
+#endif
+
+int mainloop_input_add(int sok, int flags, socket_callback func, void *data)
+{
+	socketevent *se = malloc(sizeof(socketevent));
+
+	se_list_count++;	/* this overflows at 2.2Billion, who cares!! */
+
+	se->tag = se_list_count;
+	se->sok = sok;
+	se->rread = (flags & FIA_READ) != 0;
+	se->wwrite = (flags & FIA_WRITE) != 0;
+	se->eexcept = (flags & FIA_EX) != 0;
+	se->dead = 0;
+	se->callback = func;
+	se->userdata = data;
+	se_register(se);
+
+	return se->tag;
+}
+
+void mainloop_init(void)
+{
+	tmr_heap = NULL;
+	tmr_heap_len = 0;
+	tmr_heap_size = 0;
+	memset(tmr_hash, 0, sizeof(tmr_hash));
+	tmr_running = NULL;
+	se_list = NULL;
+
+	tmr_list_count = 0;
+	se_list_count = 0;
+}
+
+/* call every timer that is due by now */
+
+static void mainloop_run_timers(void)
+{
+	timerevent *te;
+	uint64_t us;
+	int overruns;
+
+	us = mainloop_get_usec();
+	while (tmr_heap_len > 0 && us >= tmr_heap[0]->next_call)
+	{
+		te = tmr_heap[0];
+
+		/* reschedule first, so a zero interval can't starve the loop */
+		overruns = 0;
+		if (te->periodic)
+		{
+			/* absolute deadlines: late dispatch doesn't shift later calls */
+			te->next_call += te->interval;
+			if (te->next_call <= us)
 			{
-				se = (socketevent *) list->data;
-				while (se->checked)
-				{
-					list = list->next;
-					if (!list)
-						break;
-					se = (socketevent *) list->data;
-				}
+				overruns = (us - te->next_call) / te->interval + 1;
+				te->next_call += (uint64_t) overruns * te->interval;
 			}
 		}
+		else
+		{
+			te->next_call = us + (te->interval > 0 ? te->interval : 1);
+		}
+		tmr_heap_update(te);
 
-		/* now check our list of timeout events, some might need to be called! */
-		ms = mainloop_get_millisec();
-do_timers:
-		list = tmr_list;
-		while (list)
+		tmr_running = te;
+		tmr_running_removed = FALSE;
+
+		/* if the callback returns 0, it must be removed */
+		if ((te->periodic ? te->pcallback(overruns, te->userdata) : te->callback(te->userdata)) == 0 &&
+			 !tmr_running_removed)
 		{
-			te = (timerevent *) list->data;
-			list = list->next;
-			if (ms >= te->next_call)
+			mainloop_timeout_remove(te->tag);
+		}
+
+		tmr_running = NULL;
+		if (tmr_running_removed)
+		{
+			free(te);
+		}
+	}
+}
+
+/*
+	Virtual clock, for simulations and replays. Once enabled,
+	mainloop_get_usec() returns a time that only moves forward through
+	mainloop_advance(), which calls each timer at its exact deadline on
+	the way. mainloop() itself doesn't sleep while timers are queued,
+	it handles whatever input is ready and jumps to the next deadline
+	once none is left. With no timers queued there is no deadline to
+	jump to, so it blocks on the inputs.
+*/
+
+void mainloop_set_virtual_clock(uint64_t usec)
+{
+	virtual_clock = TRUE;
+	virtual_usec = usec;
+}
+
+void mainloop_advance(uint64_t usec)
+{
+	while (tmr_heap_len > 0 && tmr_heap[0]->next_call <= usec)
+	{
+		if (tmr_heap[0]->next_call > virtual_usec)
+		{
+			virtual_usec = tmr_heap[0]->next_call;
+			wakeups++;
+		}
+		mainloop_run_timers();
+	}
+
+	if (usec > virtual_usec)
+		virtual_usec = usec;
+}
+
+uint64_t mainloop_next_deadline(void)
+{
+	return tmr_heap_len ? tmr_heap[0]->next_call : 0;
+}
+
+void mainloop(void)
+{
+	bool ready;
+
+	while (!done)
+	{
+		if (virtual_clock)
+		{
+			/* don't wait, whatever is pending is handled at the current time */
+			ready = mainloop_poll_inputs(tmr_heap_len ? virtual_usec : 0);
+			mainloop_run_timers();
+			if (!ready && tmr_heap_len > 0 && tmr_heap[0]->next_call > virtual_usec)
 			{
-				/* if the callback returns 0, it must be removed */
-				if (te->callback(te->userdata) == 0)
-				{
-					mainloop_timeout_remove(te->tag);
-					goto do_timers;
-				}
-				te->next_call = ms + te->interval;
+				virtual_usec = tmr_heap[0]->next_call;
+				wakeups++;
 			}
+			continue;
 		}
 
+		/* the shortest timeout event is always at the top of the heap */
+		mainloop_poll_inputs(tmr_heap_len ? tmr_heap[0]->next_call : 0);
+		wakeups++;
+
+		/* now check our list of timeout events, some might need to be called! */
+		mainloop_run_timers();
 	}
+
+	/* mainloop_exit() ends this run only, the loop can be entered again */
+	done = FALSE;
+}
+
+/*
+	Times the loop came back from waiting for input or a timer, on the
+	virtual clock the times it moved on to the next deadline. Divided by
+	the time it took, that is how often the CPU gets woken up for us.
+*/
+
+unsigned long mainloop_get_wakeups(void)
+{
+	return wakeups;
 }
 
 void mainloop_exit(void)
@@ -11,6 +11,7 @@ typedef int bool;
 
 typedef void (*socket_callback) (int condition, void *user_data);
 typedef int (*timer_callback) (void *user_data);
+typedef int (*periodic_callback) (int overruns, void *user_data);
 
 struct socketeventRec
 {
@@ -22,6 +23,7 @@ struct socketeventRec
 	int wwrite:1;
 	int eexcept:1;
 	int checked:1;
+	int dead:1;
 };
 
 typedef struct socketeventRec socketevent;
@@ -30,10 +32,14 @@ typedef struct socketeventRec socketevent;
 struct timerRec
 {
 	timer_callback callback;
+	periodic_callback pcallback;
 	void *userdata;
-	int interval;
+	bool periodic;
+	uint64_t interval;	/* microseconds */
 	int tag;
-	uint64_t next_call;	/* milliseconds */
+	int heap_index;		/* position in the timer heap, -1 when not queued */
+	uint64_t next_call;	/* microseconds */
+	struct timerRec *hash_next;	/* tag lookup chain */
 };
 
 typedef struct timerRec timerevent;
@@ -41,10 +47,21 @@ typedef struct timerRec timerevent;
 
 void mainloop_init(void);
 uint64_t mainloop_get_millisec(void);
+uint64_t mainloop_get_usec(void);
+uint64_t mainloop_get_nsec(void);
 void mainloop(void);
+void mainloop_exit(void);
+unsigned long mainloop_get_wakeups(void);
+
+void mainloop_set_virtual_clock(uint64_t usec);
+void mainloop_advance(uint64_t usec);
+uint64_t mainloop_next_deadline(void);
 
 void mainloop_timeout_remove(int tag);
 int mainloop_timeout_add(int interval, timer_callback callback, void *userdata);
+int mainloop_timeout_add_usec(uint64_t interval, timer_callback callback, void *userdata);
+int mainloop_periodic_add(int interval, periodic_callback callback, void *userdata);
+int mainloop_periodic_add_usec(uint64_t interval, periodic_callback callback, void *userdata);
 void mainloop_timeout_override_nextcall(int tag, uint64_t next_call);
 
 void mainloop_input_remove(int tag);
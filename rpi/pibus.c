@@ -9,13 +9,38 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <linux/input.h>
 
 #include "keyboard.h"
 #include "mainloop.h"
 #include "ibus.h"
+#include "ibus-send.h"
 #include "gpio.h"
+#include "worker.h"
 
 
+/* -u total[,urgent[,normal[,low]]] */
+
+static void parse_budget(const char *arg)
+{
+	char *end;
+	int which = IBUS_BUDGET_TOTAL;
+
+	while (1)
+	{
+		ibus_set_tx_budget(which, strtol(arg, &end, 10));
+		if (*end != ',')
+		{
+			break;
+		}
+		arg = end + 1;
+		which = which == IBUS_BUDGET_TOTAL ? IBUS_PRIO_URGENT : which + 1;
+		if (which >= IBUS_PRIO_LEVELS)
+		{
+			break;
+		}
+	}
+}
 
 int main(int argc, char **argv)
 {
@@ -29,10 +54,14 @@ int main(int argc, char **argv)
 	char *startup = NULL;
 	int cdcinterval = 0;
 	bool gpio_changed = FALSE;
+	bool rx_thread = FALSE;
+	int rx_cpu = -1;
+	int log_mode = IBUS_LOG_TEXT;
+	int wheel = 0;
 
 	mainloop_init();
 
-	while ((opt = getopt(argc, argv, "c:g:s:v:bhmr")) != -1)
+	while ((opt = getopt(argc, argv, "c:g:i:l:s:t:u:v:w:x:W:bhmr")) != -1)
 	{
 		switch (opt)
 		{
@@ -46,6 +75,17 @@ int main(int argc, char **argv)
 				gpio_number = atoi(optarg);
 				gpio_changed = TRUE;
 				break;
+			case 'i':
+				ibus_set_tx_idle(atoi(optarg));
+				break;
+			case 'l':
+				if (strcmp(optarg, "binary") == 0)
+					log_mode = IBUS_LOG_BINARY;
+				else if (strcmp(optarg, "both") == 0)
+					log_mode = IBUS_LOG_TEXT | IBUS_LOG_BINARY;
+				else
+					log_mode = IBUS_LOG_TEXT;
+				break;
 			case 'm':
 				mk3 = 0;
 				break;
@@ -55,9 +95,27 @@ int main(int argc, char **argv)
 			case 's':
 				startup = strdup(optarg);
 				break;
+			case 't':
+				rx_thread = TRUE;
+				rx_cpu = atoi(optarg);
+				break;
+			case 'u':
+				parse_budget(optarg);
+				break;
 			case 'v':
 				hw_version = atoi(optarg);
 				break;
+			case 'w':
+				if (ibus_set_rotary_wheel(REL_WHEEL, atoi(optarg)) == 0)
+					wheel = REL_WHEEL;
+				break;
+			case 'W':
+				if (ibus_set_rotary_wheel(REL_HWHEEL, atoi(optarg)) == 0)
+					wheel = REL_HWHEEL;
+				break;
+			case 'x':
+				ibus_set_tx_retries(atoi(optarg));
+				break;
 			case 'h':
 			default:
 				fprintf(stderr,
@@ -67,10 +125,18 @@ int main(int argc, char **argv)
 					"\t-b           Car has bluetooth, don't use Phone and Speak buttons\n"
 					"\t-c <time>    Force CDC-info replies every <time> seconds\n"
 					"\t-g <number>  GPIO number to use for IBUS line monitor (0 = Use TH3122)\n"
+					"\t-i <bits>    Bit times the bus must be quiet before we transmit, 11-1000 (default 20)\n"
+					"\t-l <mode>    Log frames as text, binary or both (default text)\n"
 					"\t-m           Do not do MK3 style CDC announcements\n"
 					"\t-r           Do not switch to camera in reverse gear\n"
 					"\t-s <string>  Send extra string to IBUS at startup\n"
+					"\t-t <core>    Receive on a real-time thread pinned to <core> (-1 = any)\n"
+					"\t-u <list>    Bus budget in bytes/s: total[,urgent[,normal[,low]]] (0 = unlimited, default 240,0,0,60)\n"
 					"\t-v <number>  Set PiBUS hardware version\n"
+					"\t-w <gain>    Report the knob as a mouse wheel instead of Up/Down keys,\n"
+					"\t             <gain> percent faster per 10 detents/s, 0-1000 (0 = no acceleration)\n"
+					"\t-W <gain>    Same as -w on the horizontal wheel\n"
+					"\t-x <count>   Give up on a frame after <count> retransmits, 0-10 (default 5)\n"
 					"\n",
 					argv[0]);
 				return -1;
@@ -87,13 +153,20 @@ int main(int argc, char **argv)
 		gpio_number = 17;
 	}
 
+	/* before any other thread, it needs SIGCHLD blocked in all of them */
+	if (worker_init() != 0)
+	{
+		fprintf(stderr, "Can't start worker\r\n");
+		return -5;
+	}
+
 	if (gpio_init() != 0)
 	{
 		fprintf(stderr, "Can't init gpio\r\n");
 		return -4;
 	}
 
-	if (ibus_init(port, startup, bluetooth, camera, mk3, cdcinterval, gpio_number, hw_version) != 0)
+	if (ibus_init(port, startup, bluetooth, camera, mk3, cdcinterval, gpio_number, hw_version, rx_thread, rx_cpu, log_mode) != 0)
 	{
 		return -2;
 	}
@@ -104,6 +177,12 @@ int main(int argc, char **argv)
 		return -3;
 	}
 
+	if (wheel && keyboard_init_wheel() != 0)
+	{
+		fprintf(stderr, "Can't open wheel\r\n");
+		return -3;
+	}
+
 	mainloop();
 
 	gpio_cleanup();
@@ -0,0 +1,618 @@
+/*
+ * pibus-replay - feed recorded bus traffic through the real framer and
+ * message handlers, without a serial port.
+ *
+ * Reads the text log (/storage/ibus.txt) or a binary capture, replays
+ * it as fast as possible, in real time or N times faster, and reports
+ * frame rate, handler time distribution and the key/gpio/command
+ * actions the handlers took.
+ *
+ * With -V the mainloop runs on a virtual clock: every timer (30s stats,
+ * retransmits, CDC info, idle power off) fires at its exact deadline
+ * between frames, so hours of time-driven behaviour replay in moments
+ * and with the same result every run.
+ *
+ * With -c the rest of the car joins in on the virtual clock: what we
+ * send echoes back, the IKE answers time and date requests from its own
+ * clock, and sends speed/rpm every second so the bus stays awake. -m
+ * makes the IKE stop answering after that many seconds.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/timex.h>
+
+#include "mainloop.h"
+#include "ibus.h"
+#include "ibus-send.h"
+#include "capture.h"
+#include "worker.h"
+#include "timesync.h"
+#include "stub.h"
+
+
+static struct
+{
+	double speed;		/* 0 = as fast as possible */
+	bool quiet;
+	bool virtual_clock;
+	bool powered_off;
+	int64_t realtime;	/* usec, CLOCK_REALTIME minus the mainloop clock */
+	bool car;		/* -c: echo, IKE answers */
+	int64_t ike_time;	/* IKE clock at VIRTUAL_BASE, seconds since the epoch */
+	double ike_mute;	/* -m: seconds after which the IKE goes silent, 0 = never */
+
+	uint64_t first_usec;	/* log time of the first frame */
+	uint64_t start_usec;	/* wall time of the first frame */
+	uint64_t now_usec;	/* log time of the frame being handled */
+
+	uint64_t *handler_nsec;
+	long frames;
+	long frames_size;
+	long actions;
+}
+replay =
+{
+	.speed = 0,
+	.quiet = FALSE,
+	.virtual_clock = FALSE,
+	.powered_off = FALSE,
+	.realtime = 0,
+	.car = FALSE,
+	.ike_time = 0,
+	.ike_mute = 0,
+	.first_usec = 0,
+	.start_usec = 0,
+	.now_usec = 0,
+	.handler_nsec = NULL,
+	.frames = 0,
+	.frames_size = 0,
+	.actions = 0,
+};
+
+
+/* virtual time starts here, so it is never 0 */
+#define VIRTUAL_BASE 1000000
+
+/* real time, also when the mainloop runs on the virtual clock */
+static uint64_t now_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+void stub_action(const char *fmt, ...)
+{
+	va_list args;
+	uint64_t t;
+
+	if (replay.virtual_clock)
+		t = mainloop_get_usec() - VIRTUAL_BASE;
+	else
+		t = replay.now_usec - replay.first_usec;
+
+	replay.actions++;
+	if (replay.quiet)
+	{
+		return;
+	}
+
+	printf("%6llu.%06llu ", (unsigned long long) (t / 1000000), (unsigned long long) (t % 1000000));
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+/* linked with -Wl,--wrap=worker_spawn: record commands instead of running them */
+bool __wrap_worker_spawn(char *const argv[], int timeout_ms)
+{
+	char buf[512];
+	int i, len = 0;
+
+	for (i = 0; argv[i] && len < sizeof(buf) - 1; i++)
+	{
+		len += snprintf(buf + len, sizeof(buf) - len, " %s", argv[i]);
+	}
+	stub_action("spawn%s\n", buf);
+
+	/* the real thing would be gone now */
+	if (strstr(argv[0], "poweroff"))
+	{
+		replay.powered_off = TRUE;
+	}
+
+	return TRUE;
+}
+
+/* linked with -Wl,--wrap=worker_call */
+bool __wrap_worker_call(worker_func func)
+{
+	stub_action("call %s\n", func == sync ? "sync" : "?");
+
+	return TRUE;
+}
+
+/*
+	Linked with -Wl,--wrap=clock_gettime,clock_settime,adjtimex: the
+	host's clock is left alone, CLOCK_REALTIME is replay.realtime plus
+	the mainloop clock. It starts at the epoch so the time the log sets
+	comes out the same every run; a slew is applied at once.
+*/
+int __real_clock_gettime(clockid_t clock, struct timespec *ts);
+
+int __wrap_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+	int64_t usec;
+
+	if (clock != CLOCK_REALTIME)
+	{
+		return __real_clock_gettime(clock, ts);
+	}
+
+	usec = replay.realtime + (int64_t) mainloop_get_usec();
+	ts->tv_sec = usec / 1000000;
+	ts->tv_nsec = (usec % 1000000) * 1000;
+
+	return 0;
+}
+
+int __wrap_clock_settime(clockid_t clock, const struct timespec *ts)
+{
+	stub_action("settime %lld\n", (long long) ts->tv_sec);
+	replay.realtime = (int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000 - (int64_t) mainloop_get_usec();
+
+	return 0;
+}
+
+int __wrap_adjtimex(struct timex *tx)
+{
+	stub_action("adjtime %ld\n", (long) tx->offset);
+	replay.realtime += tx->offset;
+
+	return 0;
+}
+
+/*
+	The car for -c. Frames it puts on the bus go straight to ibus_feed(),
+	replay_frame() would move the clock on from inside a timer.
+*/
+
+#define CAR_ECHO_MSEC 5
+#define CAR_ANSWER_MSEC 20
+
+static void car_feed(unsigned char *msg, int length)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < length - 1; i++)
+	{
+		sum ^= msg[i];
+	}
+	msg[length - 1] = sum;
+
+	ibus_feed(msg, length, mainloop_get_usec());
+}
+
+static int car_echo(void *data)
+{
+	unsigned char *msg = data;
+
+	ibus_feed(msg + 1, msg[0], mainloop_get_usec());
+	free(msg);
+
+	return 0;
+}
+
+/* "80 0C FF 24 01 00 ' 4:08PM'" and "80 0F FF 24 02 00 '11/05/2009'", like a US IKE */
+
+static int car_ike_answer(void *data)
+{
+	unsigned char msg[17] = { 0x80, 0x00, 0xFF, 0x24, 0x00, 0x00 };
+	time_t t = replay.ike_time + (mainloop_get_usec() - VIRTUAL_BASE) / 1000000;
+	struct tm tm;
+	char text[32];
+
+	localtime_r(&t, &tm);
+	msg[4] = (intptr_t) data;
+	if (msg[4] == 0x01)
+	{
+		snprintf(text, sizeof(text), "%2d:%02d%s", tm.tm_hour % 12 ? tm.tm_hour % 12 : 12, tm.tm_min, tm.tm_hour < 12 ? "AM" : "PM");
+	}
+	else
+	{
+		snprintf(text, sizeof(text), "%02d/%02d/%04d", tm.tm_mon + 1, tm.tm_mday, tm.tm_year + 1900);
+	}
+	memcpy(msg + 6, text, strlen(text));
+	msg[1] = strlen(text) + 5;
+	car_feed(msg, msg[1] + 2);
+
+	return 0;
+}
+
+static int car_speed(int overruns, void *unused)
+{
+	unsigned char msg[7] = { 0x80, 0x05, 0xBF, 0x18, 0x00, 0x20, 0x00 };
+
+	car_feed(msg, sizeof(msg));
+
+	return 1;
+}
+
+static void car_heard(const unsigned char *msg, int length)
+{
+	unsigned char *echo;
+
+	echo = malloc(length + 1);
+	echo[0] = length;
+	memcpy(echo + 1, msg, length);
+	mainloop_timeout_add(CAR_ECHO_MSEC, car_echo, echo);
+
+	if (replay.ike_mute > 0 && mainloop_get_usec() - VIRTUAL_BASE >= replay.ike_mute * 1000000)
+	{
+		return;
+	}
+
+	/* time or date request to the IKE */
+	if (length == 7 && msg[2] == 0x80 && msg[3] == 0x41 && (msg[4] == 0x01 || msg[4] == 0x02))
+	{
+		mainloop_timeout_add(CAR_ANSWER_MSEC, car_ike_answer, (void *) (intptr_t) msg[4]);
+	}
+}
+
+/* linked with -Wl,--wrap=ibus_send: record what we would transmit */
+void __real_ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number, int prio);
+
+void __wrap_ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number, int prio)
+{
+	char buf[1024];
+	int i, len = 0;
+
+	for (i = 0; i < length && len < sizeof(buf) - 4; i++)
+	{
+		len += sprintf(buf + len, " %02x", msg[i]);
+	}
+	stub_action("send%s\n", buf);
+
+	__real_ibus_send(ifd, msg, length, gpio_number, prio);
+	if (replay.car)
+	{
+		car_heard(msg, length);
+	}
+}
+
+static void replay_frame(const unsigned char *msg, int length, uint64_t usec)
+{
+	uint64_t t0, wait;
+
+	if (replay.powered_off)
+	{
+		return;
+	}
+
+	if (replay.frames == 0)
+	{
+		replay.first_usec = usec;
+		replay.start_usec = now_nsec() / 1000;
+	}
+
+	if (replay.virtual_clock)
+	{
+		/* run every timer due before this frame, then jump to it */
+		mainloop_advance(VIRTUAL_BASE + (usec - replay.first_usec));
+		if (replay.powered_off)
+		{
+			return;
+		}
+	}
+	else if (replay.speed > 0 && usec > replay.first_usec)
+	{
+		/* pace the replay against the wall clock */
+		wait = replay.start_usec + (usec - replay.first_usec) / replay.speed;
+		t0 = now_nsec() / 1000;
+		if (wait > t0)
+		{
+			usleep(wait - t0);
+		}
+	}
+
+	if (replay.frames == replay.frames_size)
+	{
+		replay.frames_size = replay.frames_size ? replay.frames_size * 2 : 4096;
+		replay.handler_nsec = realloc(replay.handler_nsec, replay.frames_size * sizeof(uint64_t));
+	}
+
+	replay.now_usec = usec;
+
+	t0 = now_nsec();
+	ibus_feed(msg, length, replay.virtual_clock ? mainloop_get_usec() : usec);
+	replay.handler_nsec[replay.frames++] = now_nsec() - t0;
+}
+
+/* "000123 68 04 18 01 ... (corrupt)" - a received frame in the text log */
+
+static int parse_text_line(const char *line, unsigned char *msg, uint64_t *usec)
+{
+	const char *p = line;
+	int length = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+	{
+		if (!isdigit((unsigned char) line[i]))
+			return 0;
+	}
+	if (line[6] != ' ')
+		return 0;
+
+	*usec = strtoull(line, NULL, 10) * 1000000;
+
+	p = line + 7;
+	while (isxdigit((unsigned char) p[0]) && isxdigit((unsigned char) p[1]) && (p[2] == ' ' || p[2] == '\n' || p[2] == 0))
+	{
+		msg[length++] = strtoul(p, NULL, 16);
+		p += (p[2] == ' ') ? 3 : 2;
+		if (length >= 257)
+			break;
+	}
+
+	if (*p != '\n' && *p != 0 && strncmp(p, "(corrupt)", 9) != 0)
+		return 0;
+
+	return length >= 2 ? length : 0;
+}
+
+static void replay_text(FILE *in)
+{
+	char line[2048];
+	unsigned char msg[257];
+	uint64_t usec, last = 0;
+	int length;
+
+	while (fgets(line, sizeof(line), in))
+	{
+		length = parse_text_line(line, msg, &usec);
+		if (length == 0)
+		{
+			continue;
+		}
+
+		/* the log only has whole seconds, keep frames of one second in order */
+		if (usec <= last)
+		{
+			usec = last + 1;
+		}
+		last = usec;
+
+		replay_frame(msg, length, usec);
+	}
+}
+
+static void replay_binary(FILE *in)
+{
+	capture_header hdr;
+	capture_record rec;
+	unsigned char msg[65536];
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1)
+	{
+		if (memcmp(&rec, CAPTURE_MAGIC, 8) == 0)
+		{
+			memcpy(&hdr, &rec, sizeof(rec));
+			if (fread((char *) &hdr + sizeof(rec), sizeof(hdr) - sizeof(rec), 1, in) != 1)
+				break;
+			fseek(in, hdr.header_size - sizeof(hdr), SEEK_CUR);
+			continue;
+		}
+
+		if (rec.length && fread(msg, rec.length, 1, in) != 1)
+		{
+			break;
+		}
+
+		/* what we wrote comes back as an echo, that's what the bus saw */
+		if (rec.direction != CAPTURE_TX)
+		{
+			replay_frame(msg, rec.length, rec.usec);
+		}
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t elapsed_usec)
+{
+	unsigned int frames, corrupt, resyncs, discarded, max_recovery;
+	uint64_t total = 0;
+	long i;
+
+	if (replay.frames == 0)
+	{
+		fprintf(stderr, "no frames\n");
+		return;
+	}
+
+	for (i = 0; i < replay.frames; i++)
+	{
+		total += replay.handler_nsec[i];
+	}
+
+	qsort(replay.handler_nsec, replay.frames, sizeof(uint64_t), cmp_u64);
+
+	fprintf(stderr,
+		"frames:    %ld in %.3f s (%.0f frames/s, %.0f frames/s handler only)\n"
+		"actions:   %ld%s\n"
+		"handler:   mean %.0f ns, p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+		replay.frames, elapsed_usec / 1e6,
+		elapsed_usec ? replay.frames * 1e6 / elapsed_usec : 0,
+		total ? replay.frames * 1e9 / total : 0,
+		replay.actions, replay.powered_off ? " (powered off)" : "",
+		(double) total / replay.frames,
+		(unsigned long long) replay.handler_nsec[replay.frames / 2],
+		(unsigned long long) replay.handler_nsec[replay.frames * 9 / 10],
+		(unsigned long long) replay.handler_nsec[replay.frames * 99 / 100],
+		(unsigned long long) replay.handler_nsec[replay.frames - 1]);
+
+	/* what the framer made of the bytes, max-recovery is the most bytes one resync took */
+	ibus_get_framer_stats(&frames, &corrupt, &resyncs, &discarded, &max_recovery);
+	fprintf(stderr, "framer:    frames=%u corrupt=%u resyncs=%u discarded=%u max-recovery=%u\n",
+		frames, corrupt, resyncs, discarded, max_recovery);
+
+	if (replay.car)
+	{
+		const timesync_stats *ts = timesync_get_stats();
+
+		fprintf(stderr, "timesync:  state=%d requests=%u edges=%u steps=%u slews=%u\n",
+			ts->state, ts->requests, ts->edges, ts->steps, ts->slews);
+	}
+
+	if (replay.virtual_clock)
+	{
+		uint64_t t = mainloop_get_usec() - VIRTUAL_BASE;
+
+		fprintf(stderr, "wakeups:   %lu in %.0f s (%.2f/s)\n", mainloop_get_wakeups(), t / 1e6,
+			t ? mainloop_get_wakeups() * 1e6 / t : 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char magic[8];
+	const char *log_path = "/dev/null";
+	int hw_version = 0;
+	int gpio_number = 18;
+	double run_on = 0;
+	uint64_t start;
+	FILE *in;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:g:m:o:s:t:v:hqV")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':
+				replay.car = TRUE;
+				replay.virtual_clock = TRUE;
+				replay.ike_time = strtoll(optarg, NULL, 10);
+				break;
+			case 'g':
+				gpio_number = atoi(optarg);
+				break;
+			case 'm':
+				replay.ike_mute = atof(optarg);
+				break;
+			case 'o':
+				log_path = optarg;
+				break;
+			case 's':
+				replay.speed = atof(optarg);
+				break;
+			case 'q':
+				replay.quiet = TRUE;
+				break;
+			case 't':
+				run_on = atof(optarg);
+				break;
+			case 'V':
+				replay.virtual_clock = TRUE;
+				break;
+			case 'v':
+				hw_version = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				fprintf(stderr,
+					"Usage: %s [flags] <ibus.txt|ibus.cap>...\n"
+					"\n"
+					"Flags:\n"
+					"\t-c <time>    Play the car on the virtual clock: echo, IKE time/date\n"
+					"\t             answers from <time> (seconds since the epoch), speed/rpm\n"
+					"\t-g <number>  GPIO number for the IBUS line monitor (0 = no transmit queue)\n"
+					"\t-m <secs>    With -c, the IKE stops answering after this long\n"
+					"\t-o <file>    Write pibus' own log here (default /dev/null)\n"
+					"\t-q           Don't print the action stream\n"
+					"\t-s <speed>   0 = as fast as possible (default), 1 = real time, N = N times faster\n"
+					"\t-t <secs>    With -V, keep the clock running this long after the last frame\n"
+					"\t-v <number>  PiBUS hardware version to emulate\n"
+					"\t-V           Run timers on a virtual clock, ignores -s\n"
+					"\n",
+					argv[0]);
+				return -1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "%s: no input\n", argv[0]);
+		return -1;
+	}
+
+	mainloop_init();
+	if (replay.virtual_clock)
+	{
+		mainloop_set_virtual_clock(VIRTUAL_BASE);
+	}
+	ibus_set_log_paths(log_path, NULL);
+
+	if (ibus_init(NULL, NULL, FALSE, TRUE, TRUE, 0, gpio_number, hw_version, FALSE, -1, IBUS_LOG_TEXT) != 0)
+	{
+		return -2;
+	}
+	if (replay.car)
+	{
+		mainloop_periodic_add(1000, car_speed, NULL);
+	}
+
+	start = now_nsec() / 1000;
+
+	for (i = optind; i < argc; i++)
+	{
+		in = fopen(argv[i], "rb");
+		if (!in)
+		{
+			perror(argv[i]);
+			return -1;
+		}
+
+		if (fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, CAPTURE_MAGIC, 8) == 0)
+		{
+			rewind(in);
+			replay_binary(in);
+		}
+		else
+		{
+			rewind(in);
+			replay_text(in);
+		}
+
+		fclose(in);
+	}
+
+	if (replay.virtual_clock && run_on > 0 && !replay.powered_off)
+	{
+		uint64_t end = mainloop_get_usec() + run_on * 1000000;
+
+		while (!replay.powered_off && mainloop_next_deadline() != 0 && mainloop_next_deadline() <= end)
+		{
+			mainloop_advance(mainloop_next_deadline());
+		}
+	}
+
+	report(now_nsec() / 1000 - start);
+
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * rx-bench - read() calls and CPU per 1000 frames on the receive path
+ *
+ * A thread plays RX_FRAMES frames of ordinary bus traffic into a pty at
+ * the bus's 9600 baud pace; the main thread takes them in through the
+ * mainloop the way ibus_read() does, two ways:
+ *
+ *   byte      one read() per byte into a frame buffer cut on the length
+ *             byte, as ibus.c did before the framer
+ *   framer    one read() of whatever the tty has, straight into the
+ *             framer (ibus-framer.c), as ibus.c does now
+ *
+ * Each runs twice: with the bytes trickling in one at a time, and with
+ * every frame arriving at once the way a UART with a FIFO hands it over.
+ * Prints read() calls, mainloop wakeups and main thread CPU time per
+ * 1000 frames.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mainloop.h"
+#include "ibus-framer.h"
+
+#define RX_FRAMES 1000
+#define BYTE_NSEC 1041667	/* 10 bits at 9600 baud */
+#define GAP_USEC 64000
+
+#define LENGTH 1
+
+static const unsigned char traffic[][12] =
+{
+	{ 0x80, 0x05, 0xBF, 0x18, 0x00, 0x20, 0x02 },
+	{ 0x00, 0x04, 0xBF, 0x72, 0x12, 0xDB },
+	{ 0xD0, 0x07, 0xBF, 0x5B, 0x00, 0x00, 0x00, 0x00, 0x33 },
+	{ 0x68, 0x03, 0x18, 0x01, 0x72 },
+	{ 0x18, 0x04, 0xFF, 0x02, 0x00, 0xE1 },
+	{ 0x50, 0x04, 0x68, 0x32, 0x11, 0x1F },
+	{ 0x80, 0x0A, 0xBF, 0x13, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x25 },
+};
+
+#define TRAFFIC (sizeof(traffic) / sizeof(traffic[0]))
+
+static struct
+{
+	int master;
+	int slave;
+	bool whole_frames;	/* write a frame at once, else byte by byte */
+	long frames;
+	long reads;
+
+	/* byte at a time reader */
+	unsigned char buf[300];
+	int pos;
+	uint64_t last_byte;
+
+	ibus_framer framer;
+}
+rxb =
+{
+	.master = -1,
+	.slave = -1,
+	.whole_frames = FALSE,
+	.frames = 0,
+	.reads = 0,
+	.pos = 0,
+	.last_byte = 0,
+};
+
+
+static int frame_length(const unsigned char *f)
+{
+	return f[LENGTH] + 2;
+}
+
+static void *writer(void *unused)
+{
+	struct timespec t;
+	const unsigned char *f;
+	int i, j, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (i = 0; i < RX_FRAMES; i++)
+	{
+		f = traffic[i % TRAFFIC];
+		n = frame_length(f);
+
+		/* one byte per byte time, or the whole frame once it is all in */
+		for (j = rxb.whole_frames ? n - 1 : 0; j < n; j++)
+		{
+			t.tv_nsec += rxb.whole_frames ? (long) n * BYTE_NSEC : BYTE_NSEC;
+			while (t.tv_nsec >= 1000000000)
+			{
+				t.tv_nsec -= 1000000000;
+				t.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+			if (rxb.whole_frames)
+			{
+				if (write(rxb.master, f, n) != n)
+					perror("write");
+			}
+			else if (write(rxb.master, f + j, 1) != 1)
+			{
+				perror("write");
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void frame_done(void)
+{
+	if (++rxb.frames == RX_FRAMES)
+	{
+		mainloop_exit();
+	}
+}
+
+static void read_error(int r)
+{
+	if (r == -1 && errno != EWOULDBLOCK)
+	{
+		perror("read");
+		exit(1);
+	}
+}
+
+/* the old ibus_read(), one byte per read() */
+static void read_bytes(int condition, void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+	unsigned char c;
+	int r;
+
+	while (1)
+	{
+		rxb.reads++;
+		if ((r = read(rxb.slave, &c, 1)) != 1)
+		{
+			read_error(r);
+			return;
+		}
+
+		if (now - rxb.last_byte > GAP_USEC)
+		{
+			rxb.pos = 0;
+		}
+		rxb.last_byte = now;
+
+		rxb.buf[rxb.pos] = c;
+		if (rxb.pos < (int) sizeof(rxb.buf) - 1)
+		{
+			rxb.pos++;
+		}
+
+		if (rxb.pos >= 4 && rxb.buf[LENGTH] + 2 == rxb.pos)
+		{
+			frame_done();
+			rxb.pos = 0;
+		}
+	}
+}
+
+static void frame_received(const unsigned char *msg, int length, uint64_t usec)
+{
+	frame_done();
+}
+
+/* the current ibus_read(), whatever the tty has into the framer */
+static void read_framer(int condition, void *unused)
+{
+	unsigned char *space;
+	int avail;
+	int r;
+
+	while (1)
+	{
+		space = ibus_framer_space(&rxb.framer, &avail);
+		rxb.reads++;
+		if ((r = read(rxb.slave, space, avail)) <= 0)
+		{
+			read_error(r);
+			return;
+		}
+
+		ibus_framer_commit(&rxb.framer, r, mainloop_get_usec(), frame_received);
+		if (r < avail)
+		{
+			return;
+		}
+	}
+}
+
+static double thread_cpu_usec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void run(const char *name, socket_callback reader, bool whole_frames)
+{
+	pthread_t thread;
+	unsigned long wakeups;
+	double cpu;
+	int tag;
+
+	rxb.whole_frames = whole_frames;
+	rxb.frames = 0;
+	rxb.reads = 0;
+	rxb.pos = 0;
+	rxb.last_byte = 0;
+	ibus_framer_init(&rxb.framer);
+
+	tag = mainloop_input_add(rxb.slave, FIA_READ, reader, NULL);
+	wakeups = mainloop_get_wakeups();
+	cpu = thread_cpu_usec();
+
+	pthread_create(&thread, NULL, writer, NULL);
+	mainloop();
+	pthread_join(thread, NULL);
+
+	cpu = thread_cpu_usec() - cpu;
+	wakeups = mainloop_get_wakeups() - wakeups;
+	mainloop_input_remove(tag);
+
+	printf("%-7s %-6s  %6.0f reads  %6.0f wakeups  %7.1f ms cpu\n", name,
+		whole_frames ? "frames" : "bytes",
+		rxb.reads * 1000.0 / RX_FRAMES, wakeups * 1000.0 / RX_FRAMES,
+		cpu / 1000 * 1000.0 / RX_FRAMES);
+}
+
+int main(int argc, char *argv[])
+{
+	struct termios tio;
+
+	rxb.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (rxb.master < 0 || grantpt(rxb.master) < 0 || unlockpt(rxb.master) < 0)
+	{
+		perror("pty");
+		return 1;
+	}
+	rxb.slave = open(ptsname(rxb.master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (rxb.slave < 0)
+	{
+		perror(ptsname(rxb.master));
+		return 1;
+	}
+	tcgetattr(rxb.slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(rxb.slave, TCSANOW, &tio);
+
+	mainloop_init();
+
+	printf("per 1000 frames, written byte by byte or a frame at a time:\n");
+	run("byte", read_bytes, FALSE);
+	run("framer", read_framer, FALSE);
+	run("byte", read_bytes, TRUE);
+	run("framer", read_framer, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "stub.h"
+
+/*
+	stub_action() for pibus-host: the stub backends report to the
+	process that started us (ibus-sim) through the fd in PIBUS_STUB_FD.
+*/
+
+void stub_action(const char *fmt, ...)
+{
+	static int fd = -2;
+	char buf[256];
+	va_list args;
+	int len;
+
+	if (fd == -2)
+	{
+		const char *env = getenv("PIBUS_STUB_FD");
+		fd = env ? atoi(env) : -1;
+	}
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len > 0)
+	{
+		write(fd, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+	}
+}
@@ -0,0 +1,2 @@
+/* side effects of the stub keyboard/gpio backends, implemented by the replay tool */
+void stub_action(const char *fmt, ...);
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/timex.h>
+
+#include "mainloop.h"
+#include "ibus.h"
+#include "timesync.h"
+
+/*
+	Keeps the system clock on the IKE's. The IKE only tells the time to
+	the minute, so a single answer leaves us up to a minute off; what
+	pins it down is the moment the minute changes. To find that edge we
+	ask for the time every TIMESYNC_HUNT_STEP until the answer moves on
+	a minute, and take the edge to be halfway between the last old and
+	the first new answer. Once locked we know about when it is due and
+	ask every TIMESYNC_HUNT_FINE instead, which pins it down closer.
+	The system clock is compared with the IKE's at that edge: a large
+	offset is stepped with clock_settime(), a small one slewed away
+	with adjtimex() so time never runs backwards.
+
+	The first answer, before any edge, steps the clock roughly into the
+	right minute. Once locked, the edge is measured again every
+	TIMESYNC_RESYNC, starting a little before it is due, which takes a
+	handful of requests instead of a time/date pair every 15s forever.
+	If no edge turns up, the next try is a TIMESYNC_RESYNC later too.
+*/
+
+#define TIMESYNC_RETRY 15000000		/* usec between requests while unsynced */
+#define TIMESYNC_HUNT_STEP 1000000	/* usec between requests looking for an edge */
+#define TIMESYNC_HUNT_FINE 250000	/* the same when we know about where it is */
+#define TIMESYNC_HUNT_LEAD 3000000	/* start that long before the expected edge */
+#define TIMESYNC_HUNT_MAX 75000000	/* no edge in that long: IKE isn't answering */
+#define TIMESYNC_RESYNC 900000000	/* usec between edges once locked */
+#define TIMESYNC_SLEW_MAX 2000000	/* larger offsets are stepped */
+#define TIMESYNC_DEADBAND 250000	/* smaller ones are left alone */
+
+#define MINUTE_USEC 60000000ULL
+
+static struct
+{
+	timesync_request_func request;
+	int tag;		/* request timer, -1 = none */
+
+	bool have_date;
+	int year, mon, day;
+	uint64_t date_usec;	/* when the date came in */
+
+	bool hunting;
+	uint64_t hunt_start;
+	int minute;		/* minute of the day the edge hunt started in, -1 = none yet */
+	uint64_t last_old;	/* usec of the last answer still in it */
+	uint64_t edge;		/* usec of the last edge */
+
+	timesync_stats stats;
+}
+ts =
+{
+	.request = NULL,
+	.tag = -1,
+	.have_date = FALSE,
+	.hunting = FALSE,
+	.minute = -1,
+	.edge = 0,
+};
+
+
+static int64_t timesync_realtime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/*
+	The IKE's local time at the start of minute, in usec since the
+	epoch, as of usec. Until we are locked the day is the IKE's date,
+	moved on a day if it is older than the time since midnight; after
+	that the system clock is within a minute or so, so the day is
+	whichever puts the minute nearest to sys.
+*/
+
+static int64_t timesync_ike_usec(int minute, int64_t sys, uint64_t usec)
+{
+	int64_t at, best = 0;
+	struct tm tm, day;
+	time_t t;
+	int d, first, last;
+
+	if (ts.stats.state == TIMESYNC_LOCKED)
+	{
+		t = sys / 1000000;
+		localtime_r(&t, &day);
+		first = -1;
+		last = 1;
+	}
+	else
+	{
+		memset(&day, 0, sizeof(day));
+		day.tm_year = ts.year - 1900;
+		day.tm_mon = ts.mon - 1;
+		day.tm_mday = ts.day;
+
+		/* a date from before midnight */
+		first = last = usec - ts.date_usec > minute * MINUTE_USEC + MINUTE_USEC / 2 ? 1 : 0;
+	}
+
+	for (d = first; d <= last; d++)
+	{
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = day.tm_year;
+		tm.tm_mon = day.tm_mon;
+		tm.tm_mday = day.tm_mday + d;
+		tm.tm_hour = minute / 60;
+		tm.tm_min = minute % 60;
+		tm.tm_isdst = -1;
+
+		at = (int64_t) mktime(&tm) * 1000000;
+		if (d == first || llabs(at - sys) < llabs(best - sys))
+		{
+			best = at;
+		}
+	}
+
+	return best;
+}
+
+/* the system clock is offset usec ahead of the IKE's */
+
+static void timesync_adjust(int64_t offset, bool slew)
+{
+	struct timespec now;
+	struct timex tx;
+	int64_t usec;
+
+	ts.stats.offset = offset;
+
+	if (slew)
+	{
+		if (llabs(offset) < TIMESYNC_DEADBAND)
+		{
+			return;
+		}
+
+		memset(&tx, 0, sizeof(tx));
+		tx.modes = ADJ_OFFSET_SINGLESHOT;
+		tx.offset = -offset;
+		if (adjtimex(&tx) == -1)
+		{
+			ibus_log("timesync: slewing %lldus failed: %s\n", (long long) -offset, strerror(errno));
+			return;
+		}
+		ts.stats.slews++;
+		ibus_log("timesync: slewing %lldus\n", (long long) -offset);
+		return;
+	}
+
+	usec = timesync_realtime() - offset;
+	now.tv_sec = usec / 1000000;
+	now.tv_nsec = (usec % 1000000) * 1000;
+	if (clock_settime(CLOCK_REALTIME, &now) != 0)
+	{
+		ibus_log("timesync: stepping %lldus failed: %s\n", (long long) -offset, strerror(errno));
+		return;
+	}
+	ts.stats.steps++;
+	ibus_log("timesync: stepped %lldus\n", (long long) -offset);
+}
+
+static int timesync_timer(void *unused);
+
+static void timesync_arm(uint64_t at)
+{
+	uint64_t now = mainloop_get_usec();
+
+	if (ts.tag != -1)
+	{
+		mainloop_timeout_remove(ts.tag);
+	}
+	ts.tag = mainloop_timeout_add_usec(at > now ? at - now : 0, timesync_timer, NULL);
+}
+
+static void timesync_ask(int what)
+{
+	ts.stats.requests++;
+	if (ts.request)
+	{
+		ts.request(what);
+	}
+}
+
+static void timesync_hunt(uint64_t now)
+{
+	ts.hunting = TRUE;
+	ts.hunt_start = now;
+	ts.minute = -1;
+	ts.stats.state = ts.stats.state == TIMESYNC_LOCKED ? TIMESYNC_LOCKED : TIMESYNC_HUNTING;
+}
+
+static uint64_t timesync_hunt_step(void)
+{
+	return ts.stats.state == TIMESYNC_LOCKED ? TIMESYNC_HUNT_FINE : TIMESYNC_HUNT_STEP;
+}
+
+static int timesync_timer(void *unused)
+{
+	uint64_t now = mainloop_get_usec();
+
+	ts.tag = -1;
+
+	if (!ts.have_date)
+	{
+		timesync_ask(TIMESYNC_DATE);
+	}
+
+	if (ts.hunting && now - ts.hunt_start > TIMESYNC_HUNT_MAX)
+	{
+		ibus_log("timesync: no minute edge, giving up for now\n");
+		ts.hunting = FALSE;
+		ts.minute = -1;
+		if (ts.stats.state == TIMESYNC_LOCKED)
+		{
+			/* the clock was right at the last edge, look again at the next resync */
+			timesync_arm(now + TIMESYNC_RESYNC);
+			return 0;
+		}
+		ts.stats.state = TIMESYNC_UNSYNCED;
+	}
+
+	if (ts.hunting)
+	{
+		timesync_ask(TIMESYNC_TIME);
+		timesync_arm(now + timesync_hunt_step());
+		return 0;
+	}
+
+	if (ts.stats.state == TIMESYNC_LOCKED)
+	{
+		/* time for the next edge */
+		timesync_hunt(now);
+		timesync_ask(TIMESYNC_TIME);
+		timesync_arm(now + timesync_hunt_step());
+		return 0;
+	}
+
+	timesync_ask(TIMESYNC_TIME);
+	timesync_arm(now + TIMESYNC_RETRY);
+
+	return 0;
+}
+
+/* the minute changed between last_old and usec */
+
+static void timesync_edge(int minute, uint64_t usec)
+{
+	uint64_t next;
+	int64_t ike, sys;
+
+	ts.edge = ts.last_old + (usec - ts.last_old) / 2;
+	ts.stats.edges++;
+
+	sys = timesync_realtime() - (int64_t) (mainloop_get_usec() - ts.edge);
+	ike = timesync_ike_usec(minute, sys, ts.edge);
+	timesync_adjust(sys - ike, ts.stats.state == TIMESYNC_LOCKED && llabs(sys - ike) <= TIMESYNC_SLEW_MAX);
+
+	ts.hunting = FALSE;
+	ts.stats.state = TIMESYNC_LOCKED;
+
+	/* the next edge TIMESYNC_RESYNC on, a little early */
+	next = ts.edge + (TIMESYNC_RESYNC / MINUTE_USEC) * MINUTE_USEC - TIMESYNC_HUNT_LEAD;
+	timesync_arm(next);
+}
+
+void timesync_handle_time(const unsigned char *msg, int length, uint64_t usec)
+{
+	int hour, min, minute;
+	int64_t ike, sys;
+
+	/* " 4:08PM" or "16:08  " */
+	if (length < 13 || msg[8] != ':' || msg[9] < '0' || msg[9] > '5' || msg[10] < '0' || msg[10] > '9')
+	{
+		return;
+	}
+
+	hour = atoi((const char *) msg + 6);
+	min = (msg[9] - '0') * 10 + msg[10] - '0';
+	if (msg[11] == 'P' && hour < 12)
+	{
+		hour += 12;
+	}
+	else if (msg[11] == 'A' && hour == 12)
+	{
+		hour = 0;
+	}
+	if (hour > 23)
+	{
+		return;
+	}
+	minute = hour * 60 + min;
+
+	if (ts.hunting && ts.minute != -1)
+	{
+		if (minute == ts.minute)
+		{
+			ts.last_old = usec;
+		}
+		else if (minute == (ts.minute + 1) % 1440)
+		{
+			timesync_edge(minute, usec);
+		}
+		else
+		{
+			/* asked too late, wait for the next one */
+			ts.minute = minute;
+			ts.last_old = usec;
+		}
+		return;
+	}
+
+	if (ts.hunting)
+	{
+		ts.minute = minute;
+		ts.last_old = usec;
+		return;
+	}
+
+	if (ts.stats.state != TIMESYNC_UNSYNCED || !ts.have_date)
+	{
+		/* someone else asked, or we can't tell the day yet */
+		return;
+	}
+
+	/* roughly into the right minute, then look for its end */
+	ts.last_old = usec;
+	sys = timesync_realtime() - (int64_t) (mainloop_get_usec() - usec);
+	ike = timesync_ike_usec(minute, sys, usec);
+	if (sys < ike || sys >= ike + (int64_t) MINUTE_USEC)
+	{
+		timesync_adjust(sys - (ike + (int64_t) MINUTE_USEC / 2), FALSE);
+	}
+
+	timesync_hunt(mainloop_get_usec());
+	ts.minute = minute;
+	ts.last_old = usec;
+	timesync_arm(mainloop_get_usec() + TIMESYNC_HUNT_STEP);
+}
+
+void timesync_handle_date(const unsigned char *msg, int length, uint64_t usec)
+{
+	static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	const char *d = (const char *) msg + 6;
+	int year, mon, day;
+	int i;
+
+	/* "26.01.2010" or "01/26/2010" */
+	if (length < 16)
+	{
+		return;
+	}
+	for (i = 0; i < 10; i++)
+	{
+		if (i != 2 && i != 5 && (d[i] < '0' || d[i] > '9'))
+		{
+			return;
+		}
+	}
+
+	if (d[2] == '/')
+	{
+		mon = atoi(d);
+		day = atoi(d + 3);
+	}
+	else
+	{
+		day = atoi(d);
+		mon = atoi(d + 3);
+	}
+	year = atoi(d + 6);
+
+	/* mktime() would quietly turn a garbled date into another one */
+	if (mon < 1 || mon > 12 || day < 1 || day > days[mon - 1] +
+		 (mon == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+	{
+		return;
+	}
+
+	ts.year = year;
+	ts.mon = mon;
+	ts.day = day;
+	ts.date_usec = usec;
+
+	if (!ts.have_date)
+	{
+		ts.have_date = TRUE;
+		ibus_log("timesync: date %04d-%02d-%02d\n", ts.year, ts.mon, ts.day);
+
+		/* ask for the time right away */
+		if (ts.stats.state == TIMESYNC_UNSYNCED)
+		{
+			timesync_arm(0);
+		}
+	}
+}
+
+void timesync_init(timesync_request_func func)
+{
+	ts.request = func;
+	ts.stats.state = TIMESYNC_UNSYNCED;
+	timesync_arm(0);
+}
+
+const timesync_stats *timesync_get_stats(void)
+{
+	return &ts.stats;
+}
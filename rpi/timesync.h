@@ -0,0 +1,26 @@
+/* what timesync wants asked of the IKE */
+#define TIMESYNC_TIME 1
+#define TIMESYNC_DATE 2
+
+/* timesync_stats.state */
+#define TIMESYNC_UNSYNCED 0
+#define TIMESYNC_HUNTING 1	/* looking for a minute edge */
+#define TIMESYNC_LOCKED 2
+
+typedef void (*timesync_request_func) (int what);
+
+typedef struct
+{
+	int state;
+	int64_t offset;		/* usec, system minus IKE at the last edge */
+	unsigned int requests;
+	unsigned int edges;	/* minute edges measured */
+	unsigned int steps;	/* clock_settime() */
+	unsigned int slews;	/* adjtimex() */
+}
+timesync_stats;
+
+void timesync_init(timesync_request_func func);
+void timesync_handle_time(const unsigned char *msg, int length, uint64_t usec);
+void timesync_handle_date(const unsigned char *msg, int length, uint64_t usec);
+const timesync_stats *timesync_get_stats(void);
@@ -0,0 +1,358 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+#include "mainloop.h"
+#include "ibus.h"
+#include "worker.h"
+
+/*
+	Side effects that may block - shell commands, sync() - run on a
+	worker thread instead of the mainloop. Jobs wait in a bounded queue;
+	when it is full the job is dropped and counted, the mainloop never
+	waits. Commands are started with posix_spawn() and not waited for:
+	SIGCHLD is blocked and comes in through a signalfd on the mainloop,
+	which reaps the child and logs how it ended. A child still running
+	after its timeout is killed. At most WORKER_CHILDREN run at a time,
+	the worker thread holds back further jobs until one is reaped.
+*/
+
+#define WORKER_JOBS 8		/* power of 2 */
+#define WORKER_ARGS 8
+#define WORKER_ARG_SPACE 256
+#define WORKER_CHILDREN 8
+
+extern char **environ;
+
+typedef struct
+{
+	worker_func func;	/* NULL: spawn args */
+	int argc;
+	int argo[WORKER_ARGS];	/* offsets into args */
+	char args[WORKER_ARG_SPACE];
+	int timeout_ms;
+}
+worker_job;
+
+typedef struct
+{
+	pid_t pid;		/* 0 = free */
+	int tag;		/* timeout, -1 = expired */
+	int timeout_ms;
+	char name[48];
+}
+worker_child;
+
+static struct
+{
+	/* under lock */
+	worker_job jobs[WORKER_JOBS];
+	unsigned int head;
+	unsigned int tail;
+	worker_child started[WORKER_CHILDREN];	/* spawned, not yet seen by the mainloop */
+	int nstarted;
+	int live;		/* spawned and not reaped */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pthread_t thread;
+	posix_spawnattr_t attr;
+	bool running;
+	int efd;		/* thread -> mainloop: children started */
+	int sfd;		/* SIGCHLD */
+
+	worker_child children[WORKER_CHILDREN];	/* mainloop only */
+	worker_stats stats;
+}
+w =
+{
+	.head = 0,
+	.tail = 0,
+	.nstarted = 0,
+	.live = 0,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.running = FALSE,
+	.efd = -1,
+	.sfd = -1,
+};
+
+
+static void *worker_thread(void *unused)
+{
+	char *argv[WORKER_ARGS + 1];
+	worker_job job;
+	worker_child *c;
+	uint64_t one = 1;
+	pid_t pid;
+	int i;
+
+	pthread_mutex_lock(&w.lock);
+
+	while (1)
+	{
+		if (w.head == w.tail || w.live == WORKER_CHILDREN)
+		{
+			pthread_cond_wait(&w.cond, &w.lock);
+			continue;
+		}
+
+		job = w.jobs[w.tail & (WORKER_JOBS - 1)];
+		w.tail++;
+		pthread_mutex_unlock(&w.lock);
+
+		if (job.func)
+		{
+			job.func();
+			pthread_mutex_lock(&w.lock);
+			continue;
+		}
+
+		for (i = 0; i < job.argc; i++)
+		{
+			argv[i] = job.args + job.argo[i];
+		}
+		argv[i] = NULL;
+
+		if (posix_spawn(&pid, argv[0], NULL, &w.attr, argv, environ) != 0)
+		{
+			__atomic_add_fetch(&w.stats.spawn_failed, 1, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&w.lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&w.lock);
+		c = &w.started[w.nstarted++];
+		c->pid = pid;
+		c->timeout_ms = job.timeout_ms;
+		snprintf(c->name, sizeof(c->name), "%s", argv[job.argc - 1]);
+		w.live++;
+		write(w.efd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+static int worker_timeout(void *data)
+{
+	worker_child *c = data;
+
+	c->tag = -1;
+	kill(-c->pid, SIGKILL);	/* with whatever it started */
+	w.stats.timed_out++;
+	ibus_log("worker: \033[31m%s timed out, killed\033[m\n", c->name);
+
+	return 0;
+}
+
+/*
+	Takes over what the thread started and reaps what has exited. Only
+	our own pids are waited for, a child that exits before we know
+	about it stays a zombie - and keeps its pid - until we do.
+*/
+
+static void worker_collect(void)
+{
+	worker_child *c;
+	int status, i, j;
+
+	pthread_mutex_lock(&w.lock);
+	for (i = 0; i < w.nstarted; i++)
+	{
+		for (j = 0; w.children[j].pid != 0; j++)
+			;
+		c = &w.children[j];
+		*c = w.started[i];
+		c->tag = mainloop_timeout_add(c->timeout_ms, worker_timeout, c);
+		w.stats.spawned++;
+		w.stats.running++;
+	}
+	w.nstarted = 0;
+	pthread_mutex_unlock(&w.lock);
+
+	for (i = 0; i < WORKER_CHILDREN; i++)
+	{
+		c = &w.children[i];
+		if (c->pid == 0 || waitpid(c->pid, &status, WNOHANG) != c->pid)
+		{
+			continue;
+		}
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		{
+			ibus_log("worker: %s done\n", c->name);
+		}
+		else
+		{
+			w.stats.failed++;
+			if (WIFEXITED(status))
+				ibus_log("worker: %s exited with %d\n", c->name, WEXITSTATUS(status));
+			else
+				ibus_log("worker: %s killed by signal %d\n", c->name, WTERMSIG(status));
+		}
+
+		if (c->tag != -1)
+		{
+			mainloop_timeout_remove(c->tag);
+		}
+		c->pid = 0;
+		w.stats.running--;
+
+		pthread_mutex_lock(&w.lock);
+		w.live--;
+		pthread_cond_signal(&w.cond);
+		pthread_mutex_unlock(&w.lock);
+	}
+}
+
+static void worker_started(int condition, void *unused)
+{
+	uint64_t count;
+
+	read(w.efd, &count, sizeof(count));
+	worker_collect();
+}
+
+static void worker_sigchld(int condition, void *unused)
+{
+	struct signalfd_siginfo si;
+
+	while (read(w.sfd, &si, sizeof(si)) == sizeof(si))
+		;
+	worker_collect();
+}
+
+/*
+	SIGCHLD must be blocked in every thread for the signalfd to get it,
+	so call this before any other thread is started.
+*/
+
+int worker_init(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	w.sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	w.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w.sfd == -1 || w.efd == -1)
+	{
+		return -1;
+	}
+
+	/* children get the default signal mask back, and a process group
+	   of their own so a timeout kills the whole command */
+	sigemptyset(&mask);
+	posix_spawnattr_init(&w.attr);
+	posix_spawnattr_setsigmask(&w.attr, &mask);
+	posix_spawnattr_setpgroup(&w.attr, 0);
+	posix_spawnattr_setflags(&w.attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+	if (pthread_create(&w.thread, NULL, worker_thread, NULL) != 0)
+	{
+		return -2;
+	}
+	w.running = TRUE;
+
+	mainloop_input_add(w.sfd, FIA_READ, worker_sigchld, NULL);
+	mainloop_input_add(w.efd, FIA_READ, worker_started, NULL);
+
+	return 0;
+}
+
+static worker_job *worker_job_alloc(void)
+{
+	if (!w.running || w.head - w.tail == WORKER_JOBS)
+	{
+		w.stats.dropped++;
+		return NULL;
+	}
+
+	return &w.jobs[w.head & (WORKER_JOBS - 1)];
+}
+
+static void worker_job_queue(void)
+{
+	w.head++;
+	w.stats.queued++;
+	pthread_cond_signal(&w.cond);
+	pthread_mutex_unlock(&w.lock);
+}
+
+/* run argv[0] (a full path) with a timeout, without waiting for it */
+
+bool worker_spawn(char *const argv[], int timeout_ms)
+{
+	worker_job *job;
+	int i, len, used = 0;
+
+	pthread_mutex_lock(&w.lock);
+	job = worker_job_alloc();
+	if (job == NULL)
+	{
+		pthread_mutex_unlock(&w.lock);
+		return FALSE;
+	}
+
+	for (i = 0; argv[i] && i < WORKER_ARGS; i++)
+	{
+		len = strlen(argv[i]) + 1;
+		if (used + len > WORKER_ARG_SPACE)
+		{
+			break;
+		}
+		memcpy(job->args + used, argv[i], len);
+		job->argo[i] = used;
+		used += len;
+	}
+
+	if (i == 0 || argv[i])
+	{
+		/* too long */
+		w.stats.dropped++;
+		pthread_mutex_unlock(&w.lock);
+		return FALSE;
+	}
+
+	job->func = NULL;
+	job->argc = i;
+	job->timeout_ms = timeout_ms;
+	worker_job_queue();
+
+	return TRUE;
+}
+
+/* run func on the worker thread, in order with the spawns */
+
+bool worker_call(worker_func func)
+{
+	worker_job *job;
+
+	pthread_mutex_lock(&w.lock);
+	job = worker_job_alloc();
+	if (job == NULL)
+	{
+		pthread_mutex_unlock(&w.lock);
+		return FALSE;
+	}
+
+	job->func = func;
+	worker_job_queue();
+
+	return TRUE;
+}
+
+const worker_stats *worker_get_stats(void)
+{
+	return &w.stats;
+}
@@ -0,0 +1,20 @@
+#define WORKER_TIMEOUT 10000	/* ms, default for worker_spawn() */
+
+typedef void (*worker_func) (void);
+
+typedef struct
+{
+	unsigned int queued;
+	unsigned int dropped;		/* job queue full */
+	unsigned int spawned;
+	unsigned int spawn_failed;
+	unsigned int timed_out;		/* killed */
+	unsigned int failed;		/* exited non-zero or by a signal */
+	int running;
+}
+worker_stats;
+
+int worker_init(void);
+bool worker_spawn(char *const argv[], int timeout_ms);
+bool worker_call(worker_func func);
+const worker_stats *worker_get_stats(void);